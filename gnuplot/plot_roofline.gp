@@ -0,0 +1,21 @@
+set terminal png size 800,600
+set output 'gnuplot/roofline_plot.png'
+
+# make roofline 產生 roofline.txt 與量到的峰值 roofline_peaks.gp
+load 'roofline_peaks.gp'
+
+set title 'Roofline: achieved GFLOP/s vs. measured FMA peak and STREAM bandwidth'
+set xlabel 'Arithmetic intensity (FLOP/byte)'
+set ylabel 'GFLOP/s'
+set logscale xy
+set xrange [0.1:1000]
+set grid
+set key left top
+set pointsize 1.5
+
+roof(x) = peak_bw * x < peak_gflops ? peak_bw * x : peak_gflops
+engines = "unoptimized main lockfree lockfree_rr lockfree_rr_SIMD"
+
+plot roof(x) title 'roofline' lt rgb 'black' lw 2, \
+     for [i = 1:words(engines)] 'roofline.txt' \
+         using (strcol(1) eq word(engines, i) ? $3 : 1/0):4 title word(engines, i) pt 7
@@ -97,7 +97,6 @@ static bool steal_batch(ring_buffer_t *q, task_t *buf, size_t *n_stolen)
 // i/j 是 8×8 內部座標，ti/tj 是 64×64 內部座標，k 主宰整個內積長度 (2048)。
 static inline void mm_tile(const task_t *task)
 {
-    printf("task->n_k:%ld\n ",task->n_k);
     for (size_t ti = 0; ti < TILE_SIZE; ti += MICRO_TILE) {
         for (size_t tj = 0; tj < TILE_SIZE; tj += MICRO_TILE) {
             float sum[MICRO_TILE][MICRO_TILE] = {0};
@@ -147,9 +146,13 @@ void *worker_thread(void *arg)
             continue;
         }
 
-        /* 試著從自己 queue 拿任務 */
-        if (try_dequeue_task(selfQ, &task))
+        /* 試著從自己 queue 拿任務；shutdown 時的 sem_post 也會被 trywait 拿到，
+         * 那格是空的，不能執行 */
+        if (try_dequeue_task(selfQ, &task)) {
+            if (atomic_load(&pool->shutdown))
+                return NULL;
             goto got_job;
+        }
 
         /* busy-wait + work stealing */
         for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
@@ -8,6 +8,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
 #include <immintrin.h>
 
 #ifndef STEAL_CHUNK
@@ -17,11 +29,74 @@
 #define TILE_SIZE 64
 #define MICRO_TILE 8
 #define MEM_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2UL << 20)
+/* worker 數上限；實際數量再取 affinity 與 cgroup CPU quota 的較小值 */
 #ifndef N_CORES
 #define N_CORES 12
 #endif
+/* mm_tile 沿 k 方向提前抓幾個 float（0 = 不 prefetch） */
+#ifndef PREFETCH_A_DIST
+#define PREFETCH_A_DIST 128
+#endif
+#ifndef PREFETCH_B_DIST
+#define PREFETCH_B_DIST 128
+#endif
+#ifndef MIXED_DIM
+#define MIXED_DIM 128   // --mixed 前景小 GEMM 的邊長
+#endif
+/* sysconf 查不到 L3 大小時的預設值 */
+#ifndef LLC_BYTES
+#define LLC_BYTES (32UL << 20)
+#endif
+#define CACHE_LINE_FLOATS (64 / sizeof(float))
+
+#ifndef STREAM_BUDGET_MB
+#define STREAM_BUDGET_MB 1024
+#endif
+/* --peak 的 STREAM triad 每個陣列的大小，要遠大於 LLC */
+#ifndef PEAK_STREAM_MB
+#define PEAK_STREAM_MB 128
+#endif
+#define PEAK_FMA_ITERS (1UL << 26)
+#define PEAK_REPS 5
+#ifndef SUMMA_PANEL
+#define SUMMA_PANEL 256   // --summa 每次廣播的 k 寬度上限
+#endif
+#define SUMMA_MAX_RANKS 64
+#define MAT_MAGIC "GEMM"
+#define PACKED_MAGIC "GEMB"
+#define PACKED_VERSION 1
+#define MAX_CHAIN 8
+
+#ifndef SKINNY_DIM
+#define SKINNY_DIM (TILE_SIZE / 2)
+#endif
+#define SKINNY_TASKS_PER_THREAD 4
+/* PLACE_HYBRID 每個 block 靜態執行的 tile 比例，其餘留給 stealing */
+#ifndef HYBRID_STATIC_PCT
+#define HYBRID_STATIC_PCT 75
+#endif
+/* split-K 每段至少這麼長，reduce 的成本相對 FMA 才可以忽略 */
+#ifndef SPLIT_K_MIN
+#define SPLIT_K_MIN 256
+#endif
+/* deterministic 模式切 k 時假設的 worker 數，與實際 thread 數無關 */
+#ifndef REPRO_THREADS
+#define REPRO_THREADS 16
+#endif
+/* A 的非零比例低於這個百分比就走 CSR kernel */
+#ifndef SPARSE_DENSITY_PCT
+#define SPARSE_DENSITY_PCT 25
+#endif
+#define SPARSE_TASKS_PER_THREAD 4
+#define SPARSE_SAMPLE_ROWS 64   // mm() 先抽這麼多個 row 估密度
 
 #define ALIGN_UP(x) (((x) + TILE_SIZE - 1) & ~(TILE_SIZE - 1))
+
+/* block 佔用表：一列 block 佔幾個 uint64_t，每個 bit 一個 64×64 block */
+static inline size_t occ_words(size_t padc) { return (padc / TILE_SIZE + 63) / 64; }
+static inline bool occ_test(const uint64_t *row, size_t b) { return row[b / 64] >> (b % 64) & 1; }
+static inline void occ_set(uint64_t *row, size_t b) { row[b / 64] |= 1ULL << (b % 64); }
 static inline void cpu_relax(void) {
 #if defined(__x86_64__) || defined(__i386__)
     __asm__ __volatile__("pause");
@@ -29,151 +104,615 @@ static inline void cpu_relax(void) {
     sched_yield();
 #endif
 }
-typedef struct {
+typedef struct task task_t;
+typedef struct task_node task_node_t;
+typedef struct gemm_job gemm_job_t;
+typedef struct gemm_plan gemm_plan_t;
+typedef void (*task_fn)(const task_t *);
+
+/* 優先等級：0 是預設，worker 永遠先看較高的等級 */
+typedef enum {
+    PRIO_NORMAL,
+    PRIO_HIGH,
+    N_PRIO,
+} prio_t;
+
+struct task {
+    task_fn run;             // kernel for this task
     float *A, *B, *C;
     size_t stride_a, stride_b, stride_c;
     size_t n_k;
-} task_t;
+    size_t rows, cols;       // output extent for non-tile kernels
+    void *arg;               // kernel-specific payload
+    task_node_t *node;       // graph node to complete, or NULL
+    gemm_job_t *job;         // async job to account to, or NULL
+    prio_t prio;             // which of the worker's queues it goes to
+};
+
+/*
+ * Page backing：≥ 2 MB 的 buffer 先試 MAP_HUGETLB（需要 hugetlbfs 預留），
+ * 失敗就 mmap 一塊對齊 2 MB 的記憶體再 madvise(MADV_HUGEPAGE) 交給 THP，
+ * 都不行才用一般 4 KB page。mm_tile 的 stride_a/stride_b 跨 row 存取
+ * 在大矩陣時每個 k 都會碰不同 page，2 MB page 可以大幅減少 TLB miss。
+ */
+typedef enum {
+    PAGES_NORMAL,
+    PAGES_THP,
+    PAGES_HUGETLB,
+} page_backing_t;
+
+static const char *const backing_name[] = {"4K", "THP", "hugetlb"};
+
+static size_t page_size(void)
+{
+    static size_t ps;
+    if (!ps)
+        ps = (size_t)sysconf(_SC_PAGESIZE);
+    return ps;
+}
+
+/* page_alloc(bytes, huge) 實際 map 的大小 */
+static size_t page_round(size_t bytes, bool huge)
+{
+    size_t g = huge && bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : page_size();
+    return (bytes + g - 1) & ~(g - 1);
+}
+
+static void *page_alloc(size_t bytes, bool huge, size_t *map_len, page_backing_t *backing)
+{
+    const int prot = PROT_READ | PROT_WRITE, flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    size_t len = page_round(bytes, huge);
+    uint8_t *p;
+
+    if (huge && bytes >= HUGE_PAGE_SIZE) {
+        p = mmap(NULL, len, prot, flags | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *map_len = len;
+            *backing = PAGES_HUGETLB;
+            return p;
+        }
+
+        /* 多要 2 MB，切掉頭尾讓起點對齊 huge page */
+        size_t over = len + HUGE_PAGE_SIZE;
+        p = mmap(NULL, over, prot, flags, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        uint8_t *al = (uint8_t *)(((uintptr_t)p + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+        if (al > p)
+            munmap(p, al - p);
+        if (p + over > al + len)
+            munmap(al + len, p + over - (al + len));
+        *map_len = len;
+        *backing = madvise(al, len, MADV_HUGEPAGE) == 0 ? PAGES_THP : PAGES_NORMAL;
+        return al;
+    }
+
+    p = mmap(NULL, len, prot, flags, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    *map_len = len;
+    *backing = PAGES_NORMAL;
+    return p;
+}
+
+/* THP 只是建議，實際拿到多少 huge page 要看 smaps 的 AnonHugePages */
+static size_t smaps_anon_huge_kb(const void *addr)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    char line[256];
+    bool in_vma = false;
+    size_t kb = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        uintptr_t lo, hi;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            if (in_vma)
+                break;
+            in_vma = (uintptr_t)addr >= lo && (uintptr_t)addr < hi;
+        } else if (in_vma && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * Workspace arena：pad/pack 用的 bump allocator，跨 mm() 呼叫重複使用。
+ * 一輪裡放不下的部分先配 overflow chunk，下次 reset 時才把主 chunk
+ * 長到 high-water 的大小，所以 shape 不變時完全不會再碰 allocator。
+ */
+typedef struct ws_chunk {
+    struct ws_chunk *next;
+    uint8_t *mem;
+    size_t map_len;
+    page_backing_t backing;
+} ws_chunk_t;
+
+typedef struct {
+    uint8_t *base;        // main chunk
+    size_t size;          // bytes in main chunk
+    size_t map_len;
+    page_backing_t backing;
+    size_t used;          // bump offset into main chunk
+    ws_chunk_t *overflow; // chunks allocated since last reset
+    size_t overflow_used;
+    size_t high_water;    // max bytes handed out between two resets
+    size_t grows;         // main chunk reallocations
+    size_t resets;
+    bool huge;            // back chunks with 2 MB pages when possible
+} workspace_t;
+
+static void *ws_alloc(workspace_t *ws, size_t bytes)
+{
+    bytes = (bytes + MEM_ALIGNMENT - 1) & ~(size_t)(MEM_ALIGNMENT - 1);
+    void *p;
+    if (ws->used + bytes <= ws->size) {
+        p = ws->base + ws->used;
+        ws->used += bytes;
+    } else {
+        ws_chunk_t *c = malloc(sizeof(ws_chunk_t));
+        c->next = ws->overflow;
+        c->mem = page_alloc(bytes, ws->huge, &c->map_len, &c->backing);
+        ws->overflow = c;
+        ws->overflow_used += bytes;
+        p = c->mem;
+    }
+    if (ws->used + ws->overflow_used > ws->high_water)
+        ws->high_water = ws->used + ws->overflow_used;
+    return p;
+}
+
+static void ws_reset(workspace_t *ws)
+{
+    if (ws->overflow) {
+        while (ws->overflow) {
+            ws_chunk_t *c = ws->overflow;
+            ws->overflow = c->next;
+            munmap(c->mem, c->map_len);
+            free(c);
+        }
+        if (ws->base)
+            munmap(ws->base, ws->map_len);
+        ws->size = ws->high_water;
+        ws->base = page_alloc(ws->size, ws->huge, &ws->map_len, &ws->backing);
+        ws->grows++;
+    }
+    ws->used = 0;
+    ws->overflow_used = 0;
+    ws->resets++;
+}
+
+static void ws_release(workspace_t *ws)
+{
+    ws_reset(ws);
+    if (ws->base)
+        munmap(ws->base, ws->map_len);
+    *ws = (workspace_t){0};
+}
+
+static void ws_print_stats(const char *name, const workspace_t *ws)
+{
+    fprintf(stderr, "%-10s size %8zu KB  high-water %8zu KB  grows %zu  resets %zu\n",
+            name, ws->size >> 10, ws->high_water >> 10, ws->grows, ws->resets);
+}
+
+static void ws_print_pages(const char *name, const workspace_t *ws)
+{
+    if (ws->base)
+        fprintf(stderr, "%-10s chunk %8zu KB  %-7s  AnonHugePages %zu KB\n", name,
+                ws->map_len >> 10, backing_name[ws->backing], smaps_anon_huge_kb(ws->base));
+    for (const ws_chunk_t *c = ws->overflow; c; c = c->next)
+        fprintf(stderr, "%-10s chunk %8zu KB  %-7s  AnonHugePages %zu KB (overflow)\n", name,
+                c->map_len >> 10, backing_name[c->backing], smaps_anon_huge_kb(c->mem));
+}
+
+/*
+ * Per-worker deque：owner 從 head 拿，thief 從 tail（block 的另一端）偷。
+ * head/tail 與一個 tag 擠在同一個 64-bit word 裡用 CAS 更新；producer
+ * 每次 push 都讓 tag + 1，所以「被偷走又補回來」的 tail 不會 ABA。
+ * 每個 worker 每個優先等級各有一個 deque。
+ */
+#define RB_IDX_BITS 24
+#define RB_IDX_MASK ((1U << RB_IDX_BITS) - 1)
+
+/*
+ * slot 陣列與它的 mask 放在一起，thief 載入一次指標就拿到一致的一組。
+ * pool_reserve 換大陣列時舊的掛在 retired 上，destroy 才釋放：被搶走 CPU
+ * 的 thief 可能還拿著舊指標，CAS 失敗前都會讀它。
+ */
+typedef struct ring_slots {
+    struct ring_slots *retired;  // smaller arrays this one replaced
+    size_t mask;                 // slots - 1 (≤ 2^23 - 1)
+    task_t slot[];
+} ring_slots_t;
 
 typedef struct __attribute__((aligned(MEM_ALIGNMENT))) {
-    task_t *tasks;       // ring buffer of tasks
-    size_t capacity;     // slots per ring buffer
-    size_t mask;
-    atomic_size_t head;  // consumer index
-    atomic_size_t tail;  // producer index
-    sem_t sem;           // counts available tasks
+    ring_slots_t *_Atomic slots;
+    _Atomic uint64_t bounds; // head | tail << 24 | tag << 48
+    atomic_flag push_lock;   // producers: caller thread and graph releases
 } ring_buffer_t;
 
-typedef struct {
-    ring_buffer_t *queues;      // array of per-thread queues
-    pthread_t *threads;         // worker threads
-    size_t num_threads;         // number of workers
-    atomic_size_t next_queue;   // for round-robin dispatch
-    pthread_mutex_t done_lock;
-    pthread_cond_t all_done;
-    atomic_int tasks_remaining; // across all queues
-    _Atomic bool shutdown;
-} threadpool_t;
+static ring_slots_t *ring_slots_new(size_t capacity, ring_slots_t *retired)
+{
+    ring_slots_t *r = calloc(1, sizeof(ring_slots_t) + capacity * sizeof(task_t));
+    r->retired = retired;
+    r->mask = capacity - 1;
+    return r;
+}
 
+static void ring_slots_free(ring_slots_t *r)
+{
+    while (r) {
+        ring_slots_t *old = r->retired;
+        free(r);
+        r = old;
+    }
+}
 
-static inline bool try_dequeue_task(ring_buffer_t *q, task_t *out)
+static inline uint64_t rb_pack(uint32_t head, uint32_t tail, uint64_t tag)
+{
+    return (head & RB_IDX_MASK) | (uint64_t)(tail & RB_IDX_MASK) << RB_IDX_BITS |
+           (tag & 0xffff) << (2 * RB_IDX_BITS);
+}
+static inline uint32_t rb_head(uint64_t b) { return b & RB_IDX_MASK; }
+static inline uint32_t rb_tail(uint64_t b) { return (b >> RB_IDX_BITS) & RB_IDX_MASK; }
+static inline uint64_t rb_tag(uint64_t b) { return b >> (2 * RB_IDX_BITS); }
+static inline size_t rb_size(uint64_t b) { return (rb_tail(b) - rb_head(b)) & RB_IDX_MASK; }
+
+/*
+ * producer：寫在 tail，滿了回傳 false。worker 釋放 graph successor 時
+ * 也會 push，所以 producer 之間用 push_lock 互斥；consumer 仍然 lock-free。
+ */
+static bool rb_push(ring_buffer_t *q, const task_t *task)
 {
-    if (sem_trywait(&q->sem) != 0)      /* 目前沒任務 → EAGAIN */
-        return false;
+    bool ok = true;
+    while (atomic_flag_test_and_set_explicit(&q->push_lock, memory_order_acquire))
+        cpu_relax();
+
+    ring_slots_t *r = atomic_load_explicit(&q->slots, memory_order_acquire);
+    uint64_t b = atomic_load_explicit(&q->bounds, memory_order_acquire);
+    do {
+        if (rb_size(b) > r->mask) {
+            ok = false;
+            break;
+        }
+        r->slot[rb_tail(b) & r->mask] = *task;
+    } while (!atomic_compare_exchange_weak_explicit(
+                 &q->bounds, &b, rb_pack(rb_head(b), rb_tail(b) + 1, rb_tag(b) + 1),
+                 memory_order_release, memory_order_acquire));
+
+    atomic_flag_clear_explicit(&q->push_lock, memory_order_release);
+    return ok;
+}
 
-    size_t idx = atomic_fetch_add_explicit(&q->head, 1,
-                                           memory_order_relaxed) & q->mask;
-    *out = q->tasks[idx];
+/* owner：從 head 拿一個 */
+static inline bool try_dequeue_task(ring_buffer_t *q, task_t *out)
+{
+    ring_slots_t *r = atomic_load_explicit(&q->slots, memory_order_acquire);
+    uint64_t b = atomic_load_explicit(&q->bounds, memory_order_acquire);
+    do {
+        if (rb_size(b) == 0)
+            return false;
+        *out = r->slot[rb_head(b) & r->mask];
+    } while (!atomic_compare_exchange_weak_explicit(
+                 &q->bounds, &b, rb_pack(rb_head(b) + 1, rb_tail(b), rb_tag(b)),
+                 memory_order_acq_rel, memory_order_acquire));
     return true;
 }
 
+/* thief：從 tail 偷最多 STEAL_CHUNK 個、不超過一半，先複製再 CAS 確認 */
 static bool steal_batch(ring_buffer_t *q, task_t *buf, size_t *n_stolen)
 {
-    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
-    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    ring_slots_t *r = atomic_load_explicit(&q->slots, memory_order_acquire);
+    uint64_t b = atomic_load_explicit(&q->bounds, memory_order_acquire);
+    size_t k;
+    do {
+        size_t available = rb_size(b);
+        if (available == 0)
+            return false;
+        k = (available + 1) / 2;
+        if (k > STEAL_CHUNK)
+            k = STEAL_CHUNK;
+        uint32_t tail = rb_tail(b);
+        for (size_t i = 0; i < k; ++i)
+            buf[i] = r->slot[(tail - 1 - i) & r->mask];
+    } while (!atomic_compare_exchange_weak_explicit(
+                 &q->bounds, &b, rb_pack(rb_head(b), rb_tail(b) - k, rb_tag(b)),
+                 memory_order_acq_rel, memory_order_acquire));
+    *n_stolen = k;
+    return true;
+}
 
-    size_t available = tail - head;
-    if (available <= STEAL_CHUNK)
-        return false;                      /* 不夠就別偷 */
+typedef struct threadpool threadpool_t;
 
-    size_t new_head = head + STEAL_CHUNK;
+typedef enum {
+    PLACE_BLOCK,    // 每個 worker 一塊連續的 2D C block（預設）
+    PLACE_RR,       // 依 row-major 順序 round-robin
+    PLACE_HYBRID,   // 同 PLACE_BLOCK，但 block 前段整批靜態執行，只有尾段可偷
+} place_mode_t;
 
-    /* CAS 把 head 往前推 – claim 這一段 */
-    if (atomic_compare_exchange_strong_explicit(
-            &q->head, &head, new_head,
-            memory_order_acquire, memory_order_relaxed))
-    {
-        for (size_t k = 0; k < STEAL_CHUNK; ++k){
-            buf[k] = q->tasks[(head + k) & q->mask];
-            sem_trywait(&q->sem); 
-        }
-            
+/* worker 怎麼對應到硬體執行緒 */
+typedef enum {
+    TOPO_CORES,     // 每個 physical core 一個 worker，多出來的才用 SMT sibling（預設）
+    TOPO_SMT,       // 用所有 hardware thread，sibling 相鄰且合用 A panel
+} topology_t;
 
-        *n_stolen = STEAL_CHUNK;
-        return true;
-    }
-    return false;
+typedef struct {
+    threadpool_t *pool;
+    size_t index;
+} worker_arg_t;
+
+struct threadpool {
+    ring_buffer_t *queues;      // N_PRIO x num_threads queues, see pool_queue()
+    sem_t *wake;                // per-worker wake-up hint, not a task count
+    pthread_t *threads;         // worker threads
+    worker_arg_t *wargs;        // per-worker start arguments
+    workspace_t ws;             // caller-side pad/pack workspace
+    workspace_t split_ws;       // split-K partial C, reset by every split
+    workspace_t *thread_ws;     // per-worker scratch workspace
+    size_t num_threads;         // number of workers
+    int *cpus;                  // CPU each worker is pinned to
+    size_t *victims;            // per worker: steal order, nearest cache first
+    topology_t topo;            // fixed by init_thread_pool()
+    size_t queue_high_water;    // largest ring capacity requested
+    atomic_size_t next_queue;   // for round-robin dispatch
+    place_mode_t place;         // how mm_tiled() places tiles
+    bool stream_c;              // allow non-temporal C stores
+    bool sparse;                // let mm() switch to CSR for sparse A
+    bool block_skip;            // track zero 64x64 blocks while padding
+    bool split_k;               // let mm_tiled() split k when tiles are scarce
+    bool deterministic;         // summation order independent of num_threads
+    gemm_job_t *free_jobs;      // released async jobs, reused by gemm_submit
+    gemm_plan_t *plans;         // cached plans, see gemm_plan_create()
+    pthread_mutex_t job_lock;
+    pthread_mutex_t done_lock;
+    pthread_cond_t all_done;
+    atomic_int tasks_remaining; // across all queues
+    _Atomic bool shutdown;
+};
+
+/* worker i 在 prio 等級的 queue */
+static inline ring_buffer_t *pool_queue(threadpool_t *pool, int prio, size_t i)
+{
+    return &pool->queues[prio * pool->num_threads + i];
 }
 
+/* 目前 worker 的 scratch workspace，給需要暫存空間的 kernel 用 */
+static __thread workspace_t *tls_ws;
+
+
 // 一次計算 8*8 micro-tile，也是就是 64 個 float
-static inline void mm_tile(const task_t *task)
+// streaming: 輸出比 LLC 大時，A/B 用軟體 prefetch 提前抓，C 只寫一次不會再讀，
+// 用 non-temporal store 繞過 cache。n_k 是 pad 過的，一定是 cache line 的倍數。
+// bf16: B 是 pre-pack 成 bfloat16 的權重（stride 以 uint16_t 計），讀進來
+// 左移 16 bit 就是 float。
+static inline __attribute__((always_inline))
+void mm_tile_kernel(const task_t *task, bool streaming, bool bf16)
 {
+    const uint64_t *kmask = task->arg;   // 非零的 k-block，NULL 表示全部
     for (size_t ti = 0; ti < TILE_SIZE; ti += MICRO_TILE) {
         for (size_t tj = 0; tj < TILE_SIZE; tj += MICRO_TILE) {
 
             __m256 c[MICRO_TILE];
             for (int v = 0; v < MICRO_TILE; ++v) c[v] = _mm256_setzero_ps();
 
-            for (size_t k = 0; k < task->n_k; ++k) {
-                /* 1. broadcast A[ti~ti+7]][k] */
-                __m256 a0 = _mm256_set1_ps(task->A[(ti + 0) * task->stride_a + k]);
-                __m256 a1 = _mm256_set1_ps(task->A[(ti + 1) * task->stride_a + k]);
-                __m256 a2 = _mm256_set1_ps(task->A[(ti + 2) * task->stride_a + k]);
-                __m256 a3 = _mm256_set1_ps(task->A[(ti + 3) * task->stride_a + k]);
-                __m256 a4 = _mm256_set1_ps(task->A[(ti + 4) * task->stride_a + k]);
-                __m256 a5 = _mm256_set1_ps(task->A[(ti + 5) * task->stride_a + k]);
-                __m256 a6 = _mm256_set1_ps(task->A[(ti + 6) * task->stride_a + k]);
-                __m256 a7 = _mm256_set1_ps(task->A[(ti + 7) * task->stride_a + k]);
-
-                /* 2. 對固定 k，把 B 的 8 個 column 分別取出 */
-                const float *baseB = task->B + k; 
-                const size_t sb = task->stride_b;
+            /* 下一個 micro-tile 的 B column 開頭先抓進來 */
+            if (streaming && tj + MICRO_TILE < TILE_SIZE)
+                for (int v = 0; v < MICRO_TILE; ++v)
+                    _mm_prefetch((const char *)&task->B[(tj + MICRO_TILE + v) * task->stride_b],
+                                 _MM_HINT_T0);
+
+            for (size_t k0 = 0; k0 < task->n_k; k0 += CACHE_LINE_FLOATS) {
+                if (kmask && k0 % TILE_SIZE == 0 && !occ_test(kmask, k0 / TILE_SIZE)) {
+                    k0 += TILE_SIZE - CACHE_LINE_FLOATS;   // A 或 B 這塊全是 0
+                    continue;
+                }
+                /* 0. 每條 cache line 替 8 條 A row / 8 條 B column 各往前抓一條 */
+                if (streaming) {
+                    for (int v = 0; v < MICRO_TILE; ++v) {
+                        if (PREFETCH_A_DIST > 0)
+                            _mm_prefetch((const char *)&task->A[(ti + v) * task->stride_a + k0 +
+                                                                PREFETCH_A_DIST], _MM_HINT_T0);
+                        if (PREFETCH_B_DIST > 0)
+                            _mm_prefetch((const char *)&task->B[(tj + v) * task->stride_b + k0 +
+                                                                PREFETCH_B_DIST], _MM_HINT_T0);
+                    }
+                }
+
+                for (size_t k = k0; k < k0 + CACHE_LINE_FLOATS; ++k) {
+                    /* 1. broadcast A[ti~ti+7]][k] */
+                    __m256 a0 = _mm256_set1_ps(task->A[(ti + 0) * task->stride_a + k]);
+                    __m256 a1 = _mm256_set1_ps(task->A[(ti + 1) * task->stride_a + k]);
+                    __m256 a2 = _mm256_set1_ps(task->A[(ti + 2) * task->stride_a + k]);
+                    __m256 a3 = _mm256_set1_ps(task->A[(ti + 3) * task->stride_a + k]);
+                    __m256 a4 = _mm256_set1_ps(task->A[(ti + 4) * task->stride_a + k]);
+                    __m256 a5 = _mm256_set1_ps(task->A[(ti + 5) * task->stride_a + k]);
+                    __m256 a6 = _mm256_set1_ps(task->A[(ti + 6) * task->stride_a + k]);
+                    __m256 a7 = _mm256_set1_ps(task->A[(ti + 7) * task->stride_a + k]);
+
+                    /* 2. 對固定 k，把 B 的 8 個 column 分別取出 */
+                    const float *baseB = task->B + k; 
+                    const size_t sb = task->stride_b;
                 
-                //倒過來擺放的原因是 _mm256_set_ps 的設計是高位在前，低位在後，所以它的結構是 b[7][k]~b[0][k]，不是 b[0][k]~b[7][k]
-                __m256 b = _mm256_set_ps(
-                    baseB[(tj + 7) * sb],
-                    baseB[(tj + 6) * sb],
-                    baseB[(tj + 5) * sb],
-                    baseB[(tj + 4) * sb],
-                    baseB[(tj + 3) * sb],
-                    baseB[(tj + 2) * sb],
-                    baseB[(tj + 1) * sb],
-                    baseB[(tj + 0) * sb]);   
-
-                /* 3. FMA accumulate */
-                c[0] = _mm256_fmadd_ps(a0, b, c[0]);
-                c[1] = _mm256_fmadd_ps(a1, b, c[1]);
-                c[2] = _mm256_fmadd_ps(a2, b, c[2]);
-                c[3] = _mm256_fmadd_ps(a3, b, c[3]);
-                c[4] = _mm256_fmadd_ps(a4, b, c[4]);
-                c[5] = _mm256_fmadd_ps(a5, b, c[5]);
-                c[6] = _mm256_fmadd_ps(a6, b, c[6]);
-                c[7] = _mm256_fmadd_ps(a7, b, c[7]);
+                    //倒過來擺放的原因是 _mm256_set_ps 的設計是高位在前，低位在後，所以它的結構是 b[7][k]~b[0][k]，不是 b[0][k]~b[7][k]
+                    const uint16_t *hb = (const uint16_t *)task->B + k;
+                    __m256 b = bf16 ? _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_set_epi32(
+                        hb[(tj + 7) * sb], hb[(tj + 6) * sb], hb[(tj + 5) * sb], hb[(tj + 4) * sb],
+                        hb[(tj + 3) * sb], hb[(tj + 2) * sb], hb[(tj + 1) * sb], hb[(tj + 0) * sb]),
+                        16)) : _mm256_set_ps(
+                        baseB[(tj + 7) * sb],
+                        baseB[(tj + 6) * sb],
+                        baseB[(tj + 5) * sb],
+                        baseB[(tj + 4) * sb],
+                        baseB[(tj + 3) * sb],
+                        baseB[(tj + 2) * sb],
+                        baseB[(tj + 1) * sb],
+                        baseB[(tj + 0) * sb]);   
+
+                    /* 3. FMA accumulate */
+                    c[0] = _mm256_fmadd_ps(a0, b, c[0]);
+                    c[1] = _mm256_fmadd_ps(a1, b, c[1]);
+                    c[2] = _mm256_fmadd_ps(a2, b, c[2]);
+                    c[3] = _mm256_fmadd_ps(a3, b, c[3]);
+                    c[4] = _mm256_fmadd_ps(a4, b, c[4]);
+                    c[5] = _mm256_fmadd_ps(a5, b, c[5]);
+                    c[6] = _mm256_fmadd_ps(a6, b, c[6]);
+                    c[7] = _mm256_fmadd_ps(a7, b, c[7]);
+                }
             }
 
             /* 4. store back 8×8 */
+            for (int v = 0; v < 8; ++v) {
+                if (streaming)
+                    _mm256_stream_ps(&task->C[(ti + v) * task->stride_c + tj], c[v]);
+                else
+                    _mm256_storeu_ps(&task->C[(ti + v) * task->stride_c + tj], c[v]);
+            }
+        }
+    }
+    if (streaming)
+        _mm_sfence();
+}
+
+/* 整個 tile 的 k-block 都是 0：只要把 C 清成 0 */
+static void zero_tile(const task_t *task)
+{
+    for (size_t i = 0; i < TILE_SIZE; i++)
+        memset(task->C + i * task->stride_c, 0, TILE_SIZE * sizeof(float));
+}
+
+static void mm_tile(const task_t *task)
+{
+    mm_tile_kernel(task, false, false);
+}
+
+/* C 必須 32-byte 對齊：pad 過的 C 來自 workspace，stride 又是 64 的倍數 */
+static void mm_tile_stream(const task_t *task)
+{
+    mm_tile_kernel(task, true, false);
+}
+
+static void mm_tile_bf16(const task_t *task)
+{
+    mm_tile_kernel(task, false, true);
+}
+
+static inline float hsum256(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+/* GEMV：C[i] = A[i, :] · B[:, 0]，B 是 n×1 所以本身就連續 */
+static void gemv_rows(const task_t *task)
+{
+    const float *x = task->B;
+    for (size_t i = 0; i < task->rows; i++) {
+        const float *a = task->A + i * task->stride_a;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        size_t k = 0;
+        for (; k + 16 <= task->n_k; k += 16) {
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k), _mm256_loadu_ps(x + k), s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + k + 8), _mm256_loadu_ps(x + k + 8), s1);
+        }
+        float sum = hsum256(_mm256_add_ps(s0, s1));
+        for (; k < task->n_k; k++)
+            sum += a[k] * x[k];
+        task->C[i * task->stride_c] = sum;
+    }
+}
+
+/*
+ * Row-wise axpy：C[i, 0:cols] = Σ_k A[i][k] · B[k, 0:cols]。
+ * 每次 64 個 column 放在 8 個 register，B 的 row 連續讀，適合 n 小
+ * (rank-k update) 或 m/p 小 (tall-skinny) 的乘法。
+ */
+static void axpy_rows(const task_t *task)
+{
+    const size_t sb = task->stride_b;
+    for (size_t i = 0; i < task->rows; i++) {
+        const float *a = task->A + i * task->stride_a;
+        float *c = task->C + i * task->stride_c;
+        size_t j = 0;
+
+        for (; j + 8 * MICRO_TILE <= task->cols; j += 8 * MICRO_TILE) {
+            __m256 acc[8];
+            for (int v = 0; v < 8; ++v) acc[v] = _mm256_setzero_ps();
+            for (size_t k = 0; k < task->n_k; k++) {
+                __m256 av = _mm256_set1_ps(a[k]);
+                const float *b = task->B + k * sb + j;
+                for (int v = 0; v < 8; ++v)
+                    acc[v] = _mm256_fmadd_ps(av, _mm256_loadu_ps(b + v * 8), acc[v]);
+            }
             for (int v = 0; v < 8; ++v)
-                _mm256_storeu_ps(&task->C[(ti + v) * task->stride_c + tj], c[v]);
+                _mm256_storeu_ps(c + j + v * 8, acc[v]);
+        }
+        for (; j + MICRO_TILE <= task->cols; j += MICRO_TILE) {
+            __m256 acc = _mm256_setzero_ps();
+            for (size_t k = 0; k < task->n_k; k++)
+                acc = _mm256_fmadd_ps(_mm256_set1_ps(a[k]),
+                                      _mm256_loadu_ps(task->B + k * sb + j), acc);
+            _mm256_storeu_ps(c + j, acc);
+        }
+        for (; j < task->cols; j++) {
+            float sum = 0;
+            for (size_t k = 0; k < task->n_k; k++)
+                sum += a[k] * task->B[k * sb + j];
+            c[j] = sum;
         }
     }
 }
 
-typedef struct {
-    threadpool_t *pool;
-    size_t index;
-} worker_arg_t;
+static void task_done(threadpool_t *pool)
+{
+    if (atomic_fetch_sub(&pool->tasks_remaining, 1) == 1) {
+        pthread_mutex_lock(&pool->done_lock);
+        pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->done_lock);
+    }
+}
+
+static void graph_complete(threadpool_t *pool, size_t self, task_node_t *nd);
+static void job_task_done(gemm_job_t *job);
+static void jobs_release(threadpool_t *pool);
+static void plans_release(threadpool_t *pool);
+
+/* 先釋放 successor 再扣 tasks_remaining，計數才不會提早歸零 */
+static inline void run_task(threadpool_t *pool, size_t selfID, const task_t *task)
+{
+    task->run(task);
+    if (task->node)
+        graph_complete(pool, selfID, task->node);
+    if (task->job)
+        job_task_done(task->job);
+    task_done(pool);
+}
 
 void *worker_thread(void *arg)
 {
     worker_arg_t  *warg   = arg;
     threadpool_t  *pool   = warg->pool;
     size_t         selfID = warg->index;
-    ring_buffer_t *selfQ  = &pool->queues[selfID];
-    free(warg);
+    ring_buffer_t *highQ  = pool_queue(pool, PRIO_HIGH, selfID);
+    ring_buffer_t *selfQ  = pool_queue(pool, PRIO_NORMAL, selfID);
+    tls_ws = &pool->thread_ws[selfID];
 
     task_t task;   
     task_t steal_buf[STEAL_CHUNK]; // 偷到的任務暫存在這
     size_t steal_n = 0, steal_pos = 0;
     for (;;) {
+        /* 高優先的 task 插在偷來的 task 前面，最多只等目前這個 tile */
+        if (try_dequeue_task(highQ, &task))
+            goto got_job;
+
         /* 先吃完前面偷到的任務 */
         if (steal_pos < steal_n) {
-            mm_tile(&steal_buf[steal_pos++]);
-            atomic_fetch_sub(&pool->tasks_remaining, 1);
-            if (atomic_load(&pool->tasks_remaining) == 0) {
-                pthread_mutex_lock(&pool->done_lock);
-                pthread_cond_broadcast(&pool->all_done);
-                pthread_mutex_unlock(&pool->done_lock);
-            }
+            run_task(pool, selfID, &steal_buf[steal_pos++]);
             continue;
         }
 
@@ -181,15 +720,19 @@ void *worker_thread(void *arg)
         if (try_dequeue_task(selfQ, &task))
             goto got_job;
 
-        /* busy-wait + work stealing */
+        /* busy-wait + work stealing：每一輪都先掃過所有 victim 的高優先 queue */
         for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
-            for (size_t off = 1; off < pool->num_threads; ++off) {
-                size_t victimID = (selfID + off) % pool->num_threads;
-                ring_buffer_t *vQ = &pool->queues[victimID];
+            for (int prio = N_PRIO - 1; prio >= 0; prio--) {
+                if (try_dequeue_task(pool_queue(pool, prio, selfID), &task))
+                    goto got_job;
+                for (size_t off = 1; off < pool->num_threads; ++off) {
+                    size_t victimID = pool->victims[selfID * pool->num_threads + off];
+                    ring_buffer_t *vQ = pool_queue(pool, prio, victimID);
 
-                if (steal_batch(vQ, steal_buf, &steal_n)) {
-                    steal_pos = 0;
-                    goto continue_loop;
+                    if (steal_batch(vQ, steal_buf, &steal_n)) {
+                        steal_pos = 0;
+                        goto continue_loop;
+                    }
                 }
             }
 
@@ -199,22 +742,18 @@ void *worker_thread(void *arg)
             cpu_relax();
         }
 
-        /* sleep 等自己 queue 的任務來 */
-        sem_wait(&selfQ->sem);
+        /* 丟掉過期的喚醒 token，再確認一次自己的 queue 才睡 */
+        while (sem_trywait(&pool->wake[selfID]) == 0)
+            ;
+        if (try_dequeue_task(highQ, &task) || try_dequeue_task(selfQ, &task))
+            goto got_job;
+        sem_wait(&pool->wake[selfID]);
         if (atomic_load(&pool->shutdown))
             return NULL;
-
-        size_t idx = atomic_fetch_add_explicit(&selfQ->head, 1, memory_order_relaxed) % selfQ->capacity;
-        task = selfQ->tasks[idx];
+        continue;
 
     got_job:
-        mm_tile(&task);
-        atomic_fetch_sub(&pool->tasks_remaining, 1);
-        if (atomic_load(&pool->tasks_remaining) == 0) {
-            pthread_mutex_lock(&pool->done_lock);
-            pthread_cond_broadcast(&pool->all_done);
-            pthread_mutex_unlock(&pool->done_lock);
-        }
+        run_task(pool, selfID, &task);
 
     continue_loop:
         continue;
@@ -230,45 +769,367 @@ int next_two_power(int n)
     return power;
 }
 
-void init_thread_pool(threadpool_t *pool, size_t num_threads, size_t capacity)
+void pool_set_huge(threadpool_t *pool, bool huge)
+{
+    pool->ws.huge = huge;
+    pool->split_ws.huge = huge;
+    for (size_t i = 0; i < pool->num_threads; i++)
+        pool->thread_ws[i].huge = huge;
+}
+
+/*
+ * CPU budget
+ *
+ * 容器裡 sched_getaffinity 給的是 cpuset，cgroup 的 CPU quota（v2 的
+ * cpu.max、v1 的 cfs_quota_us / cfs_period_us）另外限制平均能用幾顆。
+ * worker 比 quota 多只會被 throttle，所以 pool 的大小取兩者較小的那個，
+ * 而且只 pin 在 cpuset 允許的 CPU 上。
+ */
+static size_t allowed_cpus(cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    if (sched_getaffinity(0, sizeof(*set), set) == 0 && CPU_COUNT(set) > 0)
+        return CPU_COUNT(set);
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long c = 0; c < (n > 0 ? n : 1) && c < CPU_SETSIZE; c++)
+        CPU_SET(c, set);
+    return CPU_COUNT(set);
+}
+
+/* 讀 dir/rel/file，再退回 dir/file（cgroup namespace 裡看到的是自己的根） */
+static FILE *cgroup_open(const char *dir, const char *rel, const char *file)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s%s/%s", dir, rel, file);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        snprintf(path, sizeof(path), "%s/%s", dir, file);
+        f = fopen(path, "r");
+    }
+    return f;
+}
+
+/* cgroup 允許的 CPU 數（可能是小數），沒有限制或查不到回傳 0 */
+static double cgroup_cpu_quota(void)
+{
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    char line[512], v2[256] = "", v1[256] = "";
+    bool has_v2 = false, has_v1 = false;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *ctrl = strchr(line, ':'), *rel = ctrl ? strchr(ctrl + 1, ':') : NULL;
+        if (!rel)
+            continue;
+        *rel++ = '\0';
+        ctrl++;
+        if (*ctrl == '\0') {
+            snprintf(v2, sizeof(v2), "%s", rel);
+            has_v2 = true;
+        }
+        for (char *tok = strtok(ctrl, ","); tok; tok = strtok(NULL, ","))
+            if (strcmp(tok, "cpu") == 0) {
+                snprintf(v1, sizeof(v1), "%s", rel);
+                has_v1 = true;
+            }
+    }
+    fclose(f);
+
+    double quota = 0, period = 0;
+    if (has_v1 && (f = cgroup_open("/sys/fs/cgroup/cpu", v1, "cpu.cfs_quota_us"))) {
+        if (fscanf(f, "%lf", &quota) != 1)
+            quota = 0;
+        fclose(f);
+        if ((f = cgroup_open("/sys/fs/cgroup/cpu", v1, "cpu.cfs_period_us"))) {
+            if (fscanf(f, "%lf", &period) != 1)
+                period = 0;
+            fclose(f);
+        }
+    } else if (has_v2 && (f = cgroup_open("/sys/fs/cgroup", v2, "cpu.max"))) {
+        /* "max 100000" 表示沒有限制 */
+        if (fscanf(f, "%lf %lf", &quota, &period) != 2)
+            quota = 0;
+        fclose(f);
+    }
+    return quota > 0 && period > 0 ? quota / period : 0;
+}
+
+/*
+ * Topology
+ *
+ * SMT sibling 共用 FMA port 與 L1，各算各的 tile 只會互搶，所以預設每個
+ * physical core 只放一個 worker。TOPO_SMT 則讓 sibling 成為相鄰的 worker，
+ * block placement 把同一列 block 的左右兩半分給它們，兩者同時讀同一組
+ * A panel，一個抓進 L1/L2 的資料另一個也用得到。偷 task 時先找共用 L2
+ * 的 worker，再找共用 L3 的，最後才跨 LLC。
+ *
+ * sysfs 的 *_list 第一個 CPU 就當作 core / L2 / L3 domain 的代號，
+ * 讀不到就當成獨立的 domain。
+ */
+typedef struct {
+    int core, l2, l3;
+} cpu_topo_t;
+
+/* list 檔（例如 "0-3,8"）的第一個數字，讀不到回傳 fallback */
+static int sysfs_first_cpu(const char *path, int fallback)
+{
+    FILE *f = fopen(path, "r");
+    int v;
+    if (!f)
+        return fallback;
+    if (fscanf(f, "%d", &v) != 1)
+        v = fallback;
+    fclose(f);
+    return v;
+}
+
+static const cpu_topo_t *cpu_topology(int cpu)
+{
+    static cpu_topo_t table[CPU_SETSIZE];
+    static bool loaded[CPU_SETSIZE];
+    char path[128];
+
+    if (!loaded[cpu]) {
+        cpu_topo_t t = {.core = cpu, .l2 = cpu, .l3 = cpu};
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+                 cpu);
+        t.core = sysfs_first_cpu(path, cpu);
+        for (int idx = 0; idx < 8; idx++) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+                     cpu, idx);
+            int level = sysfs_first_cpu(path, -1);
+            snprintf(path, sizeof(path),
+                     "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, idx);
+            if (level == 2)
+                t.l2 = sysfs_first_cpu(path, cpu);
+            else if (level == 3)
+                t.l3 = sysfs_first_cpu(path, cpu);
+        }
+        table[cpu] = t;
+        loaded[cpu] = true;
+    }
+    return &table[cpu];
+}
+
+/* 0：同一個 core，1：共用 L2，2：共用 L3，3：更遠 */
+static int cpu_distance(int a, int b)
+{
+    const cpu_topo_t *ta = cpu_topology(a), *tb = cpu_topology(b);
+    return ta->core == tb->core ? 0 : ta->l2 == tb->l2 ? 1 : ta->l3 == tb->l3 ? 2 : 3;
+}
+
+/*
+ * 允許的 CPU 依 worker 使用順序排進 out，回傳 CPU 數；*cores 是其中的
+ * physical core 數。TOPO_CORES 先放每個 core 的第一個 thread，再放
+ * sibling；TOPO_SMT 同一個 core 的 thread 排在一起。
+ */
+static size_t topo_cpus(topology_t topo, int *out, size_t *cores)
+{
+    cpu_set_t allowed, seen, placed;
+    size_t n = 0;
+    allowed_cpus(&allowed);
+    CPU_ZERO(&seen);
+    CPU_ZERO(&placed);
+    *cores = 0;
+
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, &allowed) || CPU_ISSET(c, &seen))
+            continue;
+        (*cores)++;
+        for (int s = c; s < CPU_SETSIZE; s++) {
+            if (!CPU_ISSET(s, &allowed) || cpu_topology(s)->core != cpu_topology(c)->core)
+                continue;
+            CPU_SET(s, &seen);
+            if (s == c || topo == TOPO_SMT) {
+                out[n++] = s;
+                CPU_SET(s, &placed);
+            }
+        }
+    }
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        if (CPU_ISSET(c, &allowed) && !CPU_ISSET(c, &placed))
+            out[n++] = c;
+    return n;
+}
+
+/* TOPO_SMT 下相鄰兩個 worker 是 sibling，block grid 以兩個為一組切 */
+static size_t pool_pair(const threadpool_t *pool)
+{
+    return pool->topo == TOPO_SMT ? 2 : 1;
+}
+
+/*
+ * 依 topology 決定每個 worker 的 CPU，並算出偷 task 的順序：同樣距離的
+ * victim 維持原本 (self + off) 的輪轉順序，避免大家都先去偷同一個。
+ */
+static void pool_layout(threadpool_t *pool, topology_t topo)
+{
+    size_t n = pool->num_threads, cores;
+    int *order = malloc(CPU_SETSIZE * sizeof(int));
+    size_t n_cpus = topo_cpus(topo, order, &cores);
+
+    pool->topo = topo;
+    for (size_t i = 0; i < n; i++)
+        pool->cpus[i] = order[i % n_cpus];
+    free(order);
+
+    for (size_t w = 0; w < n; w++) {
+        size_t *v = &pool->victims[w * n];
+        v[0] = w;
+        for (int d = 0, k = 1; d <= 3; d++)
+            for (size_t off = 1; off < n; off++)
+                if (cpu_distance(pool->cpus[w], pool->cpus[(w + off) % n]) == d)
+                    v[k++] = (w + off) % n;
+    }
+}
+
+/*
+ * 預設的 worker 數：min(N_CORES, 允許的 physical core 數（TOPO_SMT 時是
+ * hardware thread 數）, ceil(quota))
+ */
+size_t pool_default_threads(topology_t topo)
+{
+    int *order = malloc(CPU_SETSIZE * sizeof(int));
+    size_t cores, n = topo_cpus(topo, order, &cores);
+    free(order);
+    if (topo == TOPO_CORES)
+        n = cores;
+    double quota = cgroup_cpu_quota();
+    if (quota > 0 && (double)n > quota)
+        n = (size_t)quota + ((double)(size_t)quota < quota);
+    if (n > N_CORES)
+        n = N_CORES;
+    return n > 0 ? n : 1;
+}
+
+/*
+ * topology 在 worker 建立前就決定：cpus 與 victims 之後只有 worker 會讀，
+ * 每個 thread 一出生就 pin 在自己的 CPU 上。
+ */
+void init_thread_pool(threadpool_t *pool, size_t num_threads, size_t capacity,
+                      topology_t topo)
 {
     *pool = (threadpool_t){
         .num_threads = num_threads,
         .threads = malloc(num_threads * sizeof(pthread_t)),
-        .queues = calloc(num_threads, sizeof(ring_buffer_t)),
+        .queues = calloc(N_PRIO * num_threads, sizeof(ring_buffer_t)),
+        .wake = calloc(num_threads, sizeof(sem_t)),
+        .wargs = calloc(num_threads, sizeof(worker_arg_t)),
+        .thread_ws = calloc(num_threads, sizeof(workspace_t)),
+        .cpus = calloc(num_threads, sizeof(int)),
+        .victims = calloc(num_threads * num_threads, sizeof(size_t)),
+        .queue_high_water = next_two_power(capacity),
     };
+    pool_set_huge(pool, true);
+    pool->stream_c = true;
+    pool->sparse = true;
+    pool->block_skip = true;
+    pool->split_k = true;
     atomic_init(&pool->next_queue, 0);
+    pthread_mutex_init(&pool->job_lock, NULL);
     pthread_mutex_init(&pool->done_lock, NULL);
     pthread_cond_init(&pool->all_done, NULL);
 
-    for (size_t i = 0; i < num_threads; i++) {
+    for (size_t i = 0; i < N_PRIO * num_threads; i++) {
         ring_buffer_t *q = &pool->queues[i];
-        q->capacity = next_two_power(capacity); // ensure power of two
-        q->mask = q->capacity - 1; // for modulo operations
-        q->tasks = calloc(q->capacity, sizeof(task_t));
-        atomic_init(&q->head, 0);
-        atomic_init(&q->tail, 0);
-        sem_init(&q->sem, 0, 0);
+        atomic_init(&q->slots, ring_slots_new(pool->queue_high_water, NULL));
+        atomic_init(&q->bounds, 0);
+        atomic_flag_clear(&q->push_lock);
+    }
+
+    pool_layout(pool, topo);
 
-        worker_arg_t *warg = malloc(sizeof(worker_arg_t));
-        *warg = (worker_arg_t){.pool = pool, .index = i};
-        pthread_create(&pool->threads[i], NULL, worker_thread, warg);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    for (size_t i = 0; i < num_threads; i++) {
+        sem_init(&pool->wake[i], 0, 0);
+        pool->wargs[i] = (worker_arg_t){.pool = pool, .index = i};
 
         cpu_set_t cpuset;
         CPU_ZERO(&cpuset);
-        CPU_SET(i % N_CORES, &cpuset);
-        pthread_setaffinity_np(pool->threads[i], sizeof(cpu_set_t), &cpuset);
+        CPU_SET(pool->cpus[i], &cpuset);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+        pthread_create(&pool->threads[i], &attr, worker_thread, &pool->wargs[i]);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * 確保每個 ring buffer 至少有 capacity 個 slot。只有 pool 閒置時
+ * （沒有 task 在跑，例如 mm() 開頭）才會換 slot 陣列，此時 head == tail；
+ * 有 async job 在跑就不動，放不下的 task 由 enqueue_to 換 queue 處理。
+ * tasks_remaining == 0 不代表沒有 thief 還在讀舊陣列，所以舊的不釋放，
+ * 只掛到新陣列的 retired 上；容量每次至少翻倍，留著的總量小於新陣列。
+ */
+void pool_reserve(threadpool_t *pool, size_t capacity)
+{
+    capacity = next_two_power(capacity);
+    if (capacity <= pool->queue_high_water || atomic_load(&pool->tasks_remaining) != 0)
+        return;
+    for (size_t i = 0; i < N_PRIO * pool->num_threads; i++) {
+        ring_buffer_t *q = &pool->queues[i];
+        ring_slots_t *old = atomic_load_explicit(&q->slots, memory_order_relaxed);
+        atomic_store_explicit(&q->slots, ring_slots_new(capacity, old), memory_order_release);
+    }
+    pool->queue_high_water = capacity;
+}
+
+void pool_print_pages(const threadpool_t *pool)
+{
+    char name[32];
+    ws_print_pages("caller", &pool->ws);
+    ws_print_pages("split-K", &pool->split_ws);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        snprintf(name, sizeof(name), "worker %zu", i);
+        ws_print_pages(name, &pool->thread_ws[i]);
+    }
+}
+
+void pool_print_stats(const threadpool_t *pool)
+{
+    char name[32];
+    ws_print_stats("caller", &pool->ws);
+    ws_print_stats("split-K", &pool->split_ws);
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        snprintf(name, sizeof(name), "worker %zu", i);
+        ws_print_stats(name, &pool->thread_ws[i]);
+    }
+    fprintf(stderr, "%-10s %zu slots x %zu queues\n", "rings",
+            pool->queue_high_water, N_PRIO * pool->num_threads);
+    fprintf(stderr, "%-10s %zu on cpus", "workers", pool->num_threads);
+    for (size_t i = 0; i < pool->num_threads; i++)
+        fprintf(stderr, " %d", pool->cpus[i]);
+    fprintf(stderr, "\n");
+}
+
+/* 從 qid 開始找一個放得下、等級相同的 queue；全部滿了回傳 false */
+static bool try_enqueue(threadpool_t *pool, size_t qid, const task_t *task)
+{
+    atomic_fetch_add(&pool->tasks_remaining, 1);
+    for (size_t off = 0; off < pool->num_threads; off++) {
+        size_t w = (qid + off) % pool->num_threads;
+        if (rb_push(pool_queue(pool, task->prio, w), task)) {
+            sem_post(&pool->wake[w]);
+            return true;
+        }
     }
+    atomic_fetch_sub(&pool->tasks_remaining, 1);
+    return false;
+}
+
+/* 放進 qid 的 queue；滿了就往下一個 queue 放，全滿就等 worker 消化 */
+void enqueue_to(threadpool_t *pool, size_t qid, task_t task)
+{
+    while (!try_enqueue(pool, qid, &task))
+        cpu_relax();
 }
 
 void enqueue(threadpool_t *pool, task_t task)
 {
     size_t qid = atomic_fetch_add(&pool->next_queue, 1) % pool->num_threads;
-    ring_buffer_t *q = &pool->queues[qid];
-    size_t idx = atomic_fetch_add(&q->tail, 1) & q->mask;
-    q->tasks[idx] = task;
-    atomic_fetch_add(&pool->tasks_remaining, 1);
-    sem_post(&q->sem);
+    enqueue_to(pool, qid, task);
 }
 
 void wait_for_completion(threadpool_t *pool)
@@ -283,63 +1144,610 @@ void destroy_thread_pool(threadpool_t *pool)
 {
     atomic_store(&pool->shutdown, true);
     for (size_t i = 0; i < pool->num_threads; i++)
-        sem_post(&pool->queues[i].sem); // wake workers
+        sem_post(&pool->wake[i]); // wake workers
 
     for (size_t i = 0; i < pool->num_threads; i++)
         pthread_join(pool->threads[i], NULL);
 
-    for (size_t i = 0; i < pool->num_threads; i++) {
-        ring_buffer_t *q = &pool->queues[i];
-        free(q->tasks);
-        sem_destroy(&q->sem);
-    }
+    for (size_t i = 0; i < N_PRIO * pool->num_threads; i++)
+        ring_slots_free(atomic_load(&pool->queues[i].slots));
+    for (size_t i = 0; i < pool->num_threads; i++)
+        sem_destroy(&pool->wake[i]);
+    for (size_t i = 0; i < pool->num_threads; i++)
+        ws_release(&pool->thread_ws[i]);
+    ws_release(&pool->ws);
+    ws_release(&pool->split_ws);
+    jobs_release(pool);
+    plans_release(pool);
+    pthread_mutex_destroy(&pool->job_lock);
     free(pool->queues);
+    free(pool->wake);
     free(pool->threads);
+    free(pool->wargs);
+    free(pool->thread_ws);
+    free(pool->cpus);
+    free(pool->victims);
     pthread_mutex_destroy(&pool->done_lock);
     pthread_cond_destroy(&pool->all_done);
 }
 
-void mm(float *A,
-        float *B,
-        float *C,
-        size_t m,
-        size_t n,
-        size_t p,
-        threadpool_t *pool)
+/* 每個 queue 需要的 slot 數：round-robin 下最多 tasks / threads + 1 */
+static size_t ring_capacity(size_t n_tasks, size_t num_threads)
+{
+    size_t capacity = n_tasks / num_threads + 1;
+    if (capacity < STEAL_CHUNK + 1) capacity = STEAL_CHUNK + 1;
+    return capacity;
+}
+
+/*
+ * Task graph
+ *
+ * 每個 node 有一個 task 和「還沒完成的前置 node 數」。node 做完時把每個
+ * successor 的計數減一，歸零的就丟進 queue（見 graph_release），所以下游 GEMM 的 tile
+ * 不用等整個上游 GEMM 的 wait_for_completion。task.run == NULL 的 node
+ * 只是 join（例如「C 的第 i 個 row panel 全部完成」），在釋放它的
+ * thread 上直接往下傳，不進 queue。
+ */
+struct task_node {
+    task_t task;
+    atomic_int deps;             // unfinished predecessors
+    task_node_t **succ;          // released when this node finishes
+    size_t n_succ, cap_succ;
+};
+
+typedef struct {
+    task_node_t **nodes;
+    size_t n_nodes, cap_nodes;
+    workspace_t *ws;             // nodes and edge lists live here
+} task_graph_t;
+
+typedef void (*gemm_callback_t)(gemm_job_t *job, void *user);
+
+struct gemm_job {
+    threadpool_t *pool;
+    gemm_job_t *next_free;
+    workspace_t ws;              // pads and graph, reused by the next job
+    task_graph_t graph;
+    atomic_int remaining;        // unfinished tasks of this job
+    gemm_callback_t cb;          // runs on the worker that finishes the job
+    void *user;
+    int efd;                     // eventfd to signal, or -1
+    _Atomic bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+void graph_init(task_graph_t *g, workspace_t *ws, size_t max_nodes)
+{
+    *g = (task_graph_t){
+        .nodes = ws_alloc(ws, max_nodes * sizeof(task_node_t *)),
+        .cap_nodes = max_nodes,
+        .ws = ws,
+    };
+}
+
+/* max_succ：這個 node 最多會有幾條出邊 */
+task_node_t *graph_add(task_graph_t *g, task_t task, size_t max_succ)
+{
+    task_node_t *nd = ws_alloc(g->ws, sizeof(task_node_t));
+    *nd = (task_node_t){
+        .task = task,
+        .succ = max_succ ? ws_alloc(g->ws, max_succ * sizeof(task_node_t *)) : NULL,
+        .cap_succ = max_succ,
+    };
+    nd->task.node = nd;
+    atomic_init(&nd->deps, 0);
+    g->nodes[g->n_nodes++] = nd;
+    return nd;
+}
+
+void graph_edge(task_node_t *from, task_node_t *to)
+{
+    from->succ[from->n_succ++] = to;
+    atomic_fetch_add_explicit(&to->deps, 1, memory_order_relaxed);
+}
+
+/*
+ * 釋放 nd 的 successor。第一個 ready 的留在 self 的 queue（self 接著就做，
+ * 資料還在 cache 裡），其餘的 round-robin 分出去，try_enqueue 會叫醒收到
+ * task 的 worker；全放自己的 queue 的話，睡著的 worker 不會醒來，整條
+ * pipeline 就擠在少數幾個 worker 上。
+ */
+static void graph_release(threadpool_t *pool, size_t self, task_node_t *nd, bool *kept)
+{
+    for (size_t s = 0; s < nd->n_succ; s++) {
+        task_node_t *next = nd->succ[s];
+        if (atomic_fetch_sub_explicit(&next->deps, 1, memory_order_acq_rel) != 1)
+            continue;
+        if (!next->task.run) {
+            graph_release(pool, self, next, kept);
+            continue;
+        }
+        size_t qid = *kept ? atomic_fetch_add(&pool->next_queue, 1) % pool->num_threads : self;
+        *kept = true;
+        if (!try_enqueue(pool, qid, &next->task)) {
+            /* 所有 queue 都滿了：worker 自己做，不能在這裡等別人 */
+            atomic_fetch_add(&pool->tasks_remaining, 1);
+            run_task(pool, self, &next->task);
+        }
+    }
+}
+
+/* node 完成：在 worker self 上釋放 successor */
+static void graph_complete(threadpool_t *pool, size_t self, task_node_t *nd)
+{
+    bool kept = false;
+    graph_release(pool, self, nd, &kept);
+}
+
+/*
+ * 把沒有前置的 node 以 round-robin 丟出去，不等它們做完。root 要先全部
+ * 找出來再放：第一個 root 一開始跑，後面 node 的 deps 就可能被扣到 0，
+ * 邊放邊看 deps 會把 worker 已經放出去的 successor 再放一次。
+ */
+void graph_launch(threadpool_t *pool, task_graph_t *g)
+{
+    size_t n_tasks = 0, n_roots = 0;
+    task_node_t **roots = ws_alloc(g->ws, g->n_nodes * sizeof(task_node_t *));
+    for (size_t i = 0; i < g->n_nodes; i++) {
+        task_node_t *nd = g->nodes[i];
+        if (!nd->task.run)
+            continue;
+        n_tasks++;
+        if (atomic_load_explicit(&nd->deps, memory_order_relaxed) == 0)
+            roots[n_roots++] = nd;
+    }
+    /* successor 不一定平均分到各 queue，多留一倍；滿了 try_enqueue 會換下一個 */
+    pool_reserve(pool, ring_capacity(n_tasks, pool->num_threads) * 2);
+
+    for (size_t i = 0; i < n_roots; i++)
+        enqueue(pool, roots[i]->task);
+}
+
+void graph_run(threadpool_t *pool, task_graph_t *g)
+{
+    graph_launch(pool, g);
+    wait_for_completion(pool);
+}
+
+/*
+ * 把 tm × tp 的 tile grid 切成 gr × gc 個 block（gr * gc = num_threads），
+ * 挑 block 周長最小的切法，也就是每個 worker 要讀的 A/B panel 最少。
+ * pair > 1 時先以 pair 個 worker 為一組切，每組的 block 再沿 column
+ * 切成 pair 份，相鄰的 worker 因此共用同一組 A panel。
+ */
+static void block_grid(size_t tm, size_t tp, size_t num_threads, size_t pair,
+                       size_t *gr, size_t *gc)
+{
+    if (pair > 1 && num_threads % pair == 0) {
+        block_grid(tm, (tp + pair - 1) / pair, num_threads / pair, 1, gr, gc);
+        *gc *= pair;
+        return;
+    }
+    size_t best = SIZE_MAX;
+    for (size_t r = 1; r <= num_threads; r++) {
+        if (num_threads % r)
+            continue;
+        size_t c = num_threads / r;
+        size_t cost = (tm + r - 1) / r + (tp + c - 1) / c;
+        if (cost < best) {
+            best = cost;
+            *gr = r;
+            *gc = c;
+        }
+    }
+}
+
+static size_t llc_bytes(void)
+{
+    static size_t llc;
+    if (!llc) {
+        long v = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        llc = v > 0 ? (size_t)v : LLC_BYTES;
+    }
+    return llc;
+}
+
+static inline task_t tile_task(task_fn kern, float *A, float *B, float *C,
+                               size_t n, size_t p, size_t i, size_t j)
+{
+    return (task_t){
+        .run = kern,
+        .A = A + i * n,
+        .B = B + j * n,
+        .C = C + i * p + j,
+        .stride_a = n,
+        .stride_b = n,
+        .stride_c = p,
+        .n_k = n,
+    };
+}
+
+/*
+ * tile (i, j) 需要的 k-block 是 occ_a 第 i 列 AND occ_b 第 j 列。
+ * 全部是 1 回傳 NULL（走 dense kernel），全部是 0 回傳 zero_mask。
+ */
+static const uint64_t zero_mask[1];
+
+static const uint64_t *tile_kmask(workspace_t *ws, const uint64_t *occ_a, const uint64_t *occ_b,
+                                  size_t n, size_t i, size_t j)
+{
+    size_t words = occ_words(n), kb = n / TILE_SIZE;
+    const uint64_t *ra = occ_a + i * words, *rb = occ_b + j * words;
+    bool any = false, all = true;
+    for (size_t w = 0; w < words; w++) {
+        uint64_t full = w + 1 < words || kb % 64 == 0 ? ~0ULL : (1ULL << kb % 64) - 1;
+        uint64_t both = ra[w] & rb[w];
+        any |= both != 0;
+        all &= both == full;
+    }
+    if (all)
+        return NULL;
+    if (!any)
+        return zero_mask;
+    uint64_t *mask = ws_alloc(ws, words * sizeof(uint64_t));
+    for (size_t w = 0; w < words; w++)
+        mask[w] = ra[w] & rb[w];
+    return mask;
+}
+
+static inline task_t tile_task_occ(task_fn kern, float *A, float *B, float *C,
+                                   size_t n, size_t p, size_t i, size_t j,
+                                   const uint64_t *occ_a, const uint64_t *occ_b, workspace_t *ws)
+{
+    task_t t = tile_task(kern, A, B, C, n, p, i, j);
+    if (!occ_a)
+        return t;
+    const uint64_t *mask = tile_kmask(ws, occ_a, occ_b, n, i / TILE_SIZE, j / TILE_SIZE);
+    if (mask == zero_mask)
+        t.run = zero_tile;
+    else
+        t.arg = (void *)mask;
+    return t;
+}
+
+/* 產生 tile (i, j) 的 task；i、j 是 tile 編號 */
+typedef task_t (*tile_maker_t)(const void *ctx, size_t i, size_t j);
+/* tile (i, j) 放進 queue qid */
+typedef void (*tile_visit_t)(void *ctx, size_t qid, size_t i, size_t j);
+
+/* tile_grid_walk() 之下單一 queue 最多拿到幾個 tile */
+static size_t tile_grid_capacity(size_t tm, size_t tp, size_t threads, size_t pair,
+                                 place_mode_t place)
+{
+    if (place == PLACE_RR)
+        return ring_capacity(tm * tp, threads);
+    size_t gr = 1, gc = 1;
+    block_grid(tm, tp, threads, pair, &gr, &gc);
+    return ((tm + gr - 1) / gr) * ((tp + gc - 1) / gc);
+}
+
+/* 從 (i0, j0) 開始、寬 w 的 block 裡，蛇行順序的第 t 個 tile */
+static inline void snake_tile(size_t i0, size_t j0, size_t w, size_t t, size_t *i, size_t *j)
+{
+    size_t r = t / w, c = t % w;
+    *i = i0 + r;
+    *j = j0 + (r & 1 ? w - 1 - c : c);
+}
+
+/*
+ * 決定 tm×tp 個 tile 的 queue 與順序。PLACE_RR 依 row-major 輪流放；
+ * PLACE_BLOCK 每個 worker 拿一塊連續的 C block，block 內蛇行走訪：
+ * 同一列共用 A panel，轉彎處共用 B panel。owner 從頭做，thief 從尾巴偷，
+ * 兩邊各自保有 panel 的 locality。PLACE_HYBRID 的順序與 PLACE_BLOCK 相同。
+ */
+static void tile_grid_walk(size_t tm, size_t tp, size_t threads, size_t pair,
+                           place_mode_t place, tile_visit_t visit, void *ctx)
+{
+    if (place == PLACE_RR) {
+        for (size_t i = 0; i < tm; i++)
+            for (size_t j = 0; j < tp; j++)
+                visit(ctx, (i * tp + j) % threads, i, j);
+        return;
+    }
+
+    size_t gr = 1, gc = 1;
+    block_grid(tm, tp, threads, pair, &gr, &gc);
+    for (size_t r = 0; r < gr; r++) {
+        size_t i0 = r * tm / gr, i1 = (r + 1) * tm / gr;
+        for (size_t c = 0; c < gc; c++) {
+            size_t j0 = c * tp / gc, j1 = (c + 1) * tp / gc;
+            for (size_t t = 0, i, j; t < (i1 - i0) * (j1 - j0); t++) {
+                snake_tile(i0, j0, j1 - j0, t, &i, &j);
+                visit(ctx, r * gc + c, i, j);
+            }
+        }
+    }
+}
+
+typedef struct {
+    threadpool_t *pool;
+    tile_maker_t make;
+    const void *ctx;
+} grid_enqueue_t;
+
+static void grid_enqueue(void *ctx, size_t qid, size_t i, size_t j)
+{
+    grid_enqueue_t *g = ctx;
+    enqueue_to(g->pool, qid, g->make(g->ctx, i, j));
+}
+
+/*
+ * PLACE_HYBRID 的靜態段：一個 task 依序做完 arg 裡 n_k 個事先建好的
+ * tile task，中間不碰任何 queue。task 由 caller 建好，worker 不會去動
+ * pool->ws（tile_kmask 的 k-mask 也在 caller 這邊配）。
+ */
+static void tile_range(const task_t *task)
+{
+    const task_t *tiles = task->arg;
+    for (size_t t = 0; t < task->n_k; t++)
+        tiles[t].run(&tiles[t]);
+}
+
+/*
+ * 類似 OpenMP 的 guided：每個 block 的前 HYBRID_STATIC_PCT% 只用一次
+ * push / sem_post 交給 owner，其餘逐個 tile 放在它後面。owner 先做完
+ * 靜態段再接著做尾段，閒下來的 worker 從尾巴偷，只有尾段需要同步。
+ */
+static void enqueue_hybrid(threadpool_t *pool, size_t tm, size_t tp, grid_enqueue_t *g)
 {
-    for (size_t i = 0; i < m; i += TILE_SIZE) {
-        for (size_t j = 0; j < p; j += TILE_SIZE) {
-            task_t task = {
-                .A = A + i * n,
-                .B = B + j * n,
-                .C = C + i * p + j,
-                .stride_a = n,
-                .stride_b = n,
-                .stride_c = p,
-                .n_k = n,
-            };
-            enqueue(pool, task);
+    size_t gr = 1, gc = 1;
+    block_grid(tm, tp, pool->num_threads, pool_pair(pool), &gr, &gc);
+    for (size_t r = 0; r < gr; r++) {
+        size_t i0 = r * tm / gr, i1 = (r + 1) * tm / gr;
+        for (size_t c = 0; c < gc; c++) {
+            size_t j0 = c * tp / gc, j1 = (c + 1) * tp / gc;
+            size_t total = (i1 - i0) * (j1 - j0), n_static = total * HYBRID_STATIC_PCT / 100;
+            if (n_static > 0) {
+                task_t *tiles = ws_alloc(&pool->ws, n_static * sizeof(task_t));
+                for (size_t t = 0, i, j; t < n_static; t++) {
+                    snake_tile(i0, j0, j1 - j0, t, &i, &j);
+                    tiles[t] = g->make(g->ctx, i, j);
+                }
+                enqueue_to(pool, r * gc + c, (task_t){
+                    .run = tile_range,
+                    .arg = tiles,
+                    .n_k = n_static,
+                });
+            }
+            for (size_t t = n_static, i, j; t < total; t++) {
+                snake_tile(i0, j0, j1 - j0, t, &i, &j);
+                enqueue_to(pool, r * gc + c, g->make(g->ctx, i, j));
+            }
         }
     }
+}
+
+/* 把 tm×tp 個 tile 依 pool->place 放進 queue 並等它們做完 */
+static void enqueue_tile_grid(threadpool_t *pool, size_t tm, size_t tp,
+                              tile_maker_t make, const void *ctx)
+{
+    grid_enqueue_t g = {.pool = pool, .make = make, .ctx = ctx};
+    pool_reserve(pool, tile_grid_capacity(tm, tp, pool->num_threads, pool_pair(pool),
+                                          pool->place));
+    if (pool->place == PLACE_HYBRID)
+        enqueue_hybrid(pool, tm, tp, &g);
+    else
+        tile_grid_walk(tm, tp, pool->num_threads, pool_pair(pool), pool->place,
+                       grid_enqueue, &g);
+    wait_for_completion(pool);
+}
+
+typedef struct {
+    task_fn kern;
+    float *A, *B, *C;
+    size_t n, p;
+    const uint64_t *occ_a, *occ_b;
+    workspace_t *ws;
+} real_grid_t;
+
+static task_t real_tile(const void *ctx, size_t i, size_t j)
+{
+    const real_grid_t *g = ctx;
+    return tile_task_occ(g->kern, g->A, g->B, g->C, g->n, g->p, i * TILE_SIZE, j * TILE_SIZE,
+                         g->occ_a, g->occ_b, g->ws);
+}
+
+/*
+ * Split-K
+ *
+ * m、p 小而 n 很大時（例如 128×1M×128）只有少數幾個 tile，其他 worker
+ * 都在空轉。這時把 k 也切成 ways 段，task 變成 (i, j, k-range)，各自寫進
+ * 自己那份 partial C，全部做完後第二階段再依 k 段的順序加總。加總的
+ * 順序固定，所以同樣的 ways 每次結果都一樣，也不需要 atomic。
+ *
+ * 其他路徑每個 C 元素都由單一 task 依 k 遞增累加，與哪個 worker 執行
+ * 無關；只有 ways 取決於 thread 數。deterministic 模式改用固定的
+ * REPRO_THREADS 決定要不要切、切幾段，結果在任何 thread 數下逐 bit 相同，
+ * 代價是 worker 數與 REPRO_THREADS 不同時 task 數不是最適合的。
+ */
+static size_t split_k_ways(const threadpool_t *pool, size_t tiles, size_t n)
+{
+    size_t threads = pool->deterministic ? REPRO_THREADS : pool->num_threads;
+    if (!pool->split_k || tiles >= threads)
+        return 1;
+    size_t ways = (threads + tiles - 1) / tiles;
+    size_t max_ways = n / ALIGN_UP(SPLIT_K_MIN);
+    return ways < max_ways ? ways : max_ways > 0 ? max_ways : 1;
+}
+
+typedef struct {
+    float *A, *B, *part;
+    size_t n, p, ways;
+    size_t part_len;             // floats per partial C
+} split_grid_t;
+
+/* grid 的第 j 欄是 tile j / ways 的第 j % ways 段 k */
+static task_t split_tile(const void *ctx, size_t i, size_t j)
+{
+    const split_grid_t *g = ctx;
+    size_t s = j % g->ways, kb = g->n / TILE_SIZE;
+    size_t k0 = s * kb / g->ways * TILE_SIZE, k1 = (s + 1) * kb / g->ways * TILE_SIZE;
+    task_t t = tile_task(mm_tile, g->A, g->B, g->part + s * g->part_len, g->n, g->p,
+                         i * TILE_SIZE, j / g->ways * TILE_SIZE);
+    t.A += k0;
+    t.B += k0;
+    t.n_k = k1 - k0;
+    return t;
+}
+
+/* C[x] = Σ_s part[s][x]，s 由小到大；A 是第 0 份 partial，n_k 是份數 */
+static void sum_partials(const task_t *task)
+{
+    for (size_t x = 0; x < task->cols; x += 8) {
+        __m256 acc = _mm256_load_ps(task->A + x);
+        for (size_t s = 1; s < task->n_k; s++)
+            acc = _mm256_add_ps(acc, _mm256_load_ps(task->A + s * task->stride_a + x));
+        _mm256_store_ps(task->C + x, acc);
+    }
+}
+
+static void mm_split_k(float *A, float *B, float *C, size_t m, size_t n, size_t p,
+                       size_t ways, threadpool_t *pool)
+{
+    split_grid_t g = {
+        .A = A, .B = B, .n = n, .p = p, .ways = ways, .part_len = m * p,
+    };
+    ws_reset(&pool->split_ws);
+    g.part = ws_alloc(&pool->split_ws, ways * m * p * sizeof(float));
+    enqueue_tile_grid(pool, m / TILE_SIZE, p / TILE_SIZE * ways, split_tile, &g);
+
+    /* 每個 worker 加總一段連續的 C，切點對齊 TILE_SIZE 個 float */
+    size_t len = m * p, chunks = pool->num_threads;
+    pool_reserve(pool, ring_capacity(chunks, pool->num_threads));
+    for (size_t w = 0; w < chunks; w++) {
+        size_t x0 = w * (len / TILE_SIZE) / chunks * TILE_SIZE;
+        size_t x1 = (w + 1) * (len / TILE_SIZE) / chunks * TILE_SIZE;
+        if (x1 > x0)
+            enqueue_to(pool, w, (task_t){
+                .run = sum_partials,
+                .A = g.part + x0,
+                .C = C + x0,
+                .stride_a = g.part_len,
+                .n_k = ways,
+                .cols = x1 - x0,
+            });
+    }
     wait_for_completion(pool);
 }
 
-float *pad_mat(const float *src, size_t r, size_t c, size_t padr, size_t padc)
+/*
+ * 已 pad 的 A (m×n)、轉置後的 B (p×n)，C (m×p) 以 64×64 tile 計算。
+ * occ_a/occ_b 是 pad 時記下的 block 佔用表（可為 NULL）：tile 只算兩邊
+ * 都非零的 k-block，沒有這種 k-block 的 tile 直接寫 0。
+ */
+void mm_tiled(float *A,
+              float *B,
+              float *C,
+              size_t m,
+              size_t n,
+              size_t p,
+              const uint64_t *occ_a,
+              const uint64_t *occ_b,
+              threadpool_t *pool)
+{
+    /* tile 不夠分給每個 worker 時改切 k；block 佔用表以整段 k 為準，這裡用不上 */
+    size_t ways = split_k_ways(pool, (m / TILE_SIZE) * (p / TILE_SIZE), n);
+    if (ways > 1) {
+        mm_split_k(A, B, C, m, n, p, ways, pool);
+        return;
+    }
+
+    /* C 放不進 LLC 時資料都得從 DRAM 來：開 prefetch，C 改用 streaming store */
+    real_grid_t g = {
+        .kern = pool->stream_c && m * p * sizeof(float) > llc_bytes() ? mm_tile_stream : mm_tile,
+        .A = A, .B = B, .C = C, .n = n, .p = p,
+        .occ_a = occ_a, .occ_b = occ_b, .ws = &pool->ws,
+    };
+    enqueue_tile_grid(pool, m / TILE_SIZE, p / TILE_SIZE, real_tile, &g);
+}
+
+static bool any_nonzero(const float *x, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        if (x[i] != 0.0f)
+            return true;
+    return false;
+}
+
+/* x 裡沒有 Inf/NaN（exponent 全 1 的值） */
+static bool all_finite(const float *x, size_t len)
+{
+    const __m256i exp = _mm256_set1_epi32(0x7f800000);
+    __m256i bad = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(x + i)), exp);
+        bad = _mm256_or_si256(bad, _mm256_cmpeq_epi32(v, exp));
+    }
+    bool ok = _mm256_testz_si256(bad, bad);
+    for (; i < len; i++)
+        ok &= x[i] - x[i] == 0.0f;
+    return ok;
+}
+
+/*
+ * occ != NULL 時順便記下 pad 後每個 64×64 block 是否有非零值：第 b 列
+ * block 佔 occ_words(padc) 個 word，bit k 是第 k 個 block。已經設過的
+ * block 不再掃，dense 的資料每塊看到第一個值就停。
+ * 回傳 false 表示 src 有 Inf/NaN（只在 occ != NULL 時檢查）：0·Inf 是 NaN，
+ * 這時跳過另一邊的全零 block 會把 NaN 算成 0，呼叫端不能用 occ。
+ */
+static bool pad_into(float *dst, const float *src, size_t r, size_t c, size_t padr, size_t padc,
+                     uint64_t *occ)
 {
-    float *dst = aligned_alloc(MEM_ALIGNMENT, padr * padc * sizeof(float));
+    bool finite = true;
     memset(dst, 0, padr * padc * sizeof(float));
-    for (size_t i = 0; i < r; i++)
+    for (size_t i = 0; i < r; i++) {
         memcpy(dst + i * padc, src + i * c, c * sizeof(float));
-    return dst;
+        if (!occ)
+            continue;
+        finite &= all_finite(src + i * c, c);
+        uint64_t *row = occ + (i / TILE_SIZE) * occ_words(padc);
+        for (size_t kb = 0; kb * TILE_SIZE < c; kb++) {
+            size_t len = c - kb * TILE_SIZE < TILE_SIZE ? c - kb * TILE_SIZE : TILE_SIZE;
+            if (!occ_test(row, kb) && any_nonzero(src + i * c + kb * TILE_SIZE, len))
+                occ_set(row, kb);
+        }
+    }
+    return finite;
 }
 
-float *pad_t_mat(const float *src, size_t r, size_t c, size_t padr, size_t padc)
+/* 轉置後 block 列是 B 的 column panel，bit 是 B 的 row block（也就是 k） */
+static bool pad_t_into(float *dst, const float *src, size_t r, size_t c, size_t padr, size_t padc,
+                       uint64_t *occ)
 {
-    float *dst = aligned_alloc(MEM_ALIGNMENT, padr * padc * sizeof(float));
+    bool finite = true;
     memset(dst, 0, padr * padc * sizeof(float));
-    for (size_t i = 0; i < r; i++)
+    for (size_t i = 0; i < r; i++) {
         for (size_t j = 0; j < c; j++)
             dst[j * padr + i] = src[i * c + j];
+        if (!occ)
+            continue;
+        finite &= all_finite(src + i * c, c);
+        for (size_t jb = 0; jb * TILE_SIZE < c; jb++) {
+            uint64_t *row = occ + jb * occ_words(padr);
+            size_t len = c - jb * TILE_SIZE < TILE_SIZE ? c - jb * TILE_SIZE : TILE_SIZE;
+            if (!occ_test(row, i / TILE_SIZE) && any_nonzero(src + i * c + jb * TILE_SIZE, len))
+                occ_set(row, i / TILE_SIZE);
+        }
+    }
+    return finite;
+}
+
+float *pad_mat(workspace_t *ws, const float *src, size_t r, size_t c, size_t padr, size_t padc,
+               uint64_t *occ)
+{
+    float *dst = ws_alloc(ws, padr * padc * sizeof(float));
+    pad_into(dst, src, r, c, padr, padc, occ);
+    return dst;
+}
+
+float *pad_t_mat(workspace_t *ws, const float *src, size_t r, size_t c, size_t padr, size_t padc,
+                 uint64_t *occ)
+{
+    float *dst = ws_alloc(ws, padr * padc * sizeof(float));
+    pad_t_into(dst, src, r, c, padr, padc, occ);
     return dst;
 }
 
@@ -354,84 +1762,2639 @@ void unpad_mat(const float *src,
         memcpy(dst + i * c, src + i * padc, c * sizeof(float));
 }
 
-void fill_rand(float *arr, size_t size)
+/*
+ * Shape-aware dispatch
+ *
+ * 64×64 tile 對 p == 1 (GEMV)、m == 1 或某一維很小的乘法很浪費：padding
+ * 後大部分是 0，ALIGN_UP 也讓記憶體膨脹到 64 倍。這些 shape 直接在原始
+ * row-major 資料上算，沿著長的那一維切 task 丟進同一個 pool。
+ */
+typedef enum {
+    SHAPE_TILED,    // 一般 64×64 tile
+    SHAPE_GEMV,     // p == 1：每個 row 一個 dot product
+    SHAPE_SKINNY,   // m、p 或 n 很小：row-wise axpy，B 的 row 連續讀
+} shape_t;
+
+static shape_t classify_shape(size_t m, size_t n, size_t p)
 {
-    for (size_t i = 0; i < size; i++)
-        arr[i] = (float)rand() / RAND_MAX;
+    if (p == 1)
+        return SHAPE_GEMV;
+    if (m < SKINNY_DIM || p < SKINNY_DIM || n < SKINNY_DIM)
+        return SHAPE_SKINNY;
+    return SHAPE_TILED;
 }
 
-size_t parse_int(const char *s)
+static void mm_skinny(const float *A, const float *B, float *C,
+                      size_t m, size_t n, size_t p,
+                      shape_t shape, threadpool_t *pool)
 {
-    return strtoul(s, NULL, 10);
+    /* GEMV 與 tall-skinny 沿 m 切；m 小（含 m == 1）就沿 p 切 */
+    bool by_rows = shape == SHAPE_GEMV || m >= p;
+    size_t len = by_rows ? m : p;
+    size_t chunks = pool->num_threads * SKINNY_TASKS_PER_THREAD;
+    size_t step = (len + chunks - 1) / chunks;
+    if (!by_rows)
+        step = (step + MICRO_TILE - 1) & ~(size_t)(MICRO_TILE - 1);
+
+    size_t n_tasks = (len + step - 1) / step;
+    pool_reserve(pool, ring_capacity(n_tasks, pool->num_threads));
+
+    for (size_t s = 0; s < len; s += step) {
+        size_t cnt = len - s < step ? len - s : step;
+        task_t task = {
+            .run = shape == SHAPE_GEMV ? gemv_rows : axpy_rows,
+            .A = (float *)A + (by_rows ? s * n : 0),
+            .B = (float *)B + (by_rows ? 0 : s),
+            .C = C + (by_rows ? s * p : s),
+            .stride_a = n,
+            .stride_b = p,
+            .stride_c = p,
+            .n_k = n,
+            .rows = by_rows ? cnt : m,
+            .cols = by_rows ? p : cnt,
+        };
+        enqueue(pool, task);
+    }
+    wait_for_completion(pool);
 }
-void print_mat(const float *mat, size_t m, size_t n)
+
+/* C (m×p) = A (m×n) · B (n×p)，三者都是未 pad 的 row-major */
+/*
+ * Sparse A (CSR) × dense B
+ *
+ * 剪枝後的權重 80–95% 是 0，dense tile 只是在乘 0。A 夠稀疏時轉成 CSR，
+ * 每個 task 負責一段連續的 row，切點讓每段的 nnz（加上每個 row 寫 C 的
+ * 成本）大致相同；kernel 和 axpy_rows 一樣一次累加 64 個 column，
+ * 只是 k 只走非零的位置。
+ */
+typedef struct {
+    size_t rows, cols, nnz;
+    size_t *row_ptr;     // rows + 1 個，指向 col_idx/val
+    uint32_t *col_idx;
+    float *val;
+} csr_t;
+
+static size_t count_nnz(const float *A, size_t len)
+{
+    size_t nnz = 0;
+    for (size_t i = 0; i < len; i++)
+        nnz += A[i] != 0.0f;
+    return nnz;
+}
+
+/*
+ * 等距抽 SPARSE_SAMPLE_ROWS 個 row 估 A 的密度。dense 的 A 只付
+ * O(SPARSE_SAMPLE_ROWS·n)，看起來夠稀疏才完整數一次 nnz（反正建 CSR
+ * 也要整個掃過）。
+ */
+static bool looks_sparse(const float *A, size_t m, size_t n)
 {
+    size_t rows = m < SPARSE_SAMPLE_ROWS ? m : SPARSE_SAMPLE_ROWS, nnz = 0;
+    for (size_t s = 0; s < rows; s++)
+        nnz += count_nnz(A + s * m / rows * n, n);
+    return nnz * 100 < rows * n * SPARSE_DENSITY_PCT;
+}
+
+/* 在 ws 裡建 A 的 CSR；nnz 由 count_nnz() 先算好 */
+csr_t *csr_from_dense(workspace_t *ws, const float *A, size_t m, size_t n, size_t nnz)
+{
+    csr_t *s = ws_alloc(ws, sizeof(csr_t));
+    *s = (csr_t){
+        .rows = m,
+        .cols = n,
+        .nnz = nnz,
+        .row_ptr = ws_alloc(ws, (m + 1) * sizeof(size_t)),
+        .col_idx = ws_alloc(ws, nnz * sizeof(uint32_t)),
+        .val = ws_alloc(ws, nnz * sizeof(float)),
+    };
+    size_t k = 0;
     for (size_t i = 0; i < m; i++) {
+        s->row_ptr[i] = k;
         for (size_t j = 0; j < n; j++) {
-            printf("%.6f", mat[i * n + j]);
-            if (j < n - 1)
-                printf(", ");
+            float v = A[i * n + j];
+            if (v != 0.0f) {
+                s->col_idx[k] = j;
+                s->val[k++] = v;
+            }
         }
-        printf("\n");
     }
-    printf("---\n");
+    s->row_ptr[m] = k;
+    return s;
 }
-int main(int argc, char *argv[])
+
+/* C[i, 0:cols] = Σ A[i][k] · B[k, 0:cols]，k 只走 row i 的非零項 */
+static void csr_rows(const task_t *task)
 {
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s <m> <n> <p>\n", argv[0]);
-        return 1;
+    const csr_t *a = task->arg;
+    const size_t sb = task->stride_b;
+    for (size_t i = 0; i < a->rows; i++) {
+        size_t k0 = a->row_ptr[i], k1 = a->row_ptr[i + 1];
+        float *c = task->C + i * task->stride_c;
+        size_t j = 0;
+
+        for (; j + 8 * MICRO_TILE <= task->cols; j += 8 * MICRO_TILE) {
+            __m256 acc[8];
+            for (int v = 0; v < 8; ++v) acc[v] = _mm256_setzero_ps();
+            for (size_t k = k0; k < k1; k++) {
+                __m256 av = _mm256_set1_ps(a->val[k]);
+                const float *b = task->B + a->col_idx[k] * sb + j;
+                for (int v = 0; v < 8; ++v)
+                    acc[v] = _mm256_fmadd_ps(av, _mm256_loadu_ps(b + v * 8), acc[v]);
+            }
+            for (int v = 0; v < 8; ++v)
+                _mm256_storeu_ps(c + j + v * 8, acc[v]);
+        }
+        for (; j + MICRO_TILE <= task->cols; j += MICRO_TILE) {
+            __m256 acc = _mm256_setzero_ps();
+            for (size_t k = k0; k < k1; k++)
+                acc = _mm256_fmadd_ps(_mm256_set1_ps(a->val[k]),
+                                      _mm256_loadu_ps(task->B + a->col_idx[k] * sb + j), acc);
+            _mm256_storeu_ps(c + j, acc);
+        }
+        for (; j < task->cols; j++) {
+            float sum = 0;
+            for (size_t k = k0; k < k1; k++)
+                sum += a->val[k] * task->B[a->col_idx[k] * sb + j];
+            c[j] = sum;
+        }
     }
+}
 
-    size_t m = parse_int(argv[1]);
-    size_t n = parse_int(argv[2]);
-    size_t p = parse_int(argv[3]);
+/*
+ * C (rows×p) = A (CSR) · B (cols×p)，B/C 都是 row-major、沒有 padding。
+ * 每個 task 的 row view 放在 pool->ws，跟 CSR 本身一樣留到下次 ws_reset()。
+ */
+void mm_csr(const csr_t *A, const float *B, float *C, size_t p, threadpool_t *pool)
+{
+    size_t max_tasks = pool->num_threads * SPARSE_TASKS_PER_THREAD;
+    size_t target = (A->nnz + A->rows + max_tasks - 1) / max_tasks;
+    /* 每個 task 一個 row 範圍的 view，row_ptr 仍指向同一份 col_idx/val */
+    csr_t *views = ws_alloc(&pool->ws, max_tasks * sizeof(csr_t));
+    pool_reserve(pool, ring_capacity(max_tasks, pool->num_threads));
 
-    threadpool_t pool;
+    size_t n_tasks = 0, r0 = 0;
+    while (r0 < A->rows) {
+        size_t r1 = r0, work = 0;
+        while (r1 < A->rows && (work < target || n_tasks == max_tasks - 1)) {
+            work += A->row_ptr[r1 + 1] - A->row_ptr[r1] + 1;
+            r1++;
+        }
+        views[n_tasks] = (csr_t){
+            .rows = r1 - r0,
+            .cols = A->cols,
+            .nnz = A->row_ptr[r1] - A->row_ptr[r0],
+            .row_ptr = A->row_ptr + r0,
+            .col_idx = A->col_idx,
+            .val = A->val,
+        };
+        enqueue(pool, (task_t){
+            .run = csr_rows,
+            .B = (float *)B,
+            .C = C + r0 * p,
+            .stride_b = p,
+            .stride_c = p,
+            .rows = r1 - r0,
+            .cols = p,
+            .arg = &views[n_tasks],
+        });
+        n_tasks++;
+        r0 = r1;
+    }
+    wait_for_completion(pool);
+}
+
+void mm(const float *A,
+        const float *B,
+        float *C,
+        size_t m,
+        size_t n,
+        size_t p,
+        threadpool_t *pool)
+{
+    /*
+     * p 太小時掃 A 數 nnz 的成本和乘法本身差不多，不值得。CSR 不乘 A 的零，
+     * B 有 Inf/NaN 時 0 · Inf 會變成 0 而不是 NaN，這時留在 dense 路徑。
+     */
+    if (pool->sparse && p >= SKINNY_DIM && looks_sparse(A, m, n)) {
+        size_t nnz = count_nnz(A, m * n);
+        if (nnz * 100 < m * n * SPARSE_DENSITY_PCT && all_finite(B, n * p)) {
+            ws_reset(&pool->ws);
+            mm_csr(csr_from_dense(&pool->ws, A, m, n, nnz), B, C, p, pool);
+            return;
+        }
+    }
 
-    float *A = malloc(m * n * sizeof(float));
-    float *B = malloc(n * p * sizeof(float));
-    float *C = malloc(m * p * sizeof(float));
-    fill_rand(A, m * n);
-    fill_rand(B, n * p);
+    shape_t shape = classify_shape(m, n, p);
+    if (shape != SHAPE_TILED) {
+        mm_skinny(A, B, C, m, n, p, shape, pool);
+        return;
+    }
 
     size_t padm = ALIGN_UP(m), padn = ALIGN_UP(n), padp = ALIGN_UP(p);
-    size_t capacity = (padm / TILE_SIZE) * (padp / TILE_SIZE) / N_CORES + 1; 
-    if (capacity < STEAL_CHUNK + 1) capacity = STEAL_CHUNK + 1;
-    init_thread_pool(&pool, N_CORES, capacity);
+    ws_reset(&pool->ws);
+    uint64_t *occ_a = NULL, *occ_b = NULL;
+    if (pool->block_skip &&
+        split_k_ways(pool, (padm / TILE_SIZE) * (padp / TILE_SIZE), padn) == 1) {
+        size_t bytes_a = padm / TILE_SIZE * occ_words(padn) * sizeof(uint64_t);
+        size_t bytes_b = padp / TILE_SIZE * occ_words(padn) * sizeof(uint64_t);
+        occ_a = memset(ws_alloc(&pool->ws, bytes_a), 0, bytes_a);
+        occ_b = memset(ws_alloc(&pool->ws, bytes_b), 0, bytes_b);
+    }
+    float *padA = ws_alloc(&pool->ws, padm * padn * sizeof(float));
+    float *padB = ws_alloc(&pool->ws, padp * padn * sizeof(float));
+    float *padC = ws_alloc(&pool->ws, padm * padp * sizeof(float));
+    bool finite = pad_into(padA, A, m, n, padm, padn, occ_a);
+    finite &= pad_t_into(padB, B, n, p, padn, padp, occ_b);
+    if (!finite)
+        occ_a = occ_b = NULL;   // 有 Inf/NaN 就照 IEEE 全部算
 
-    float *padA = pad_mat(A, m, n, padm, padn);
-    float *padB = pad_t_mat(B, n, p, padn, padp);
-    float *padC = aligned_alloc(MEM_ALIGNMENT, padm * padp * sizeof(float));
-    memset(padC, 0, padm * padp * sizeof(float));
+    mm_tiled(padA, padB, padC, padm, padn, padp, occ_a, occ_b, pool);
+    unpad_mat(padC, C, m, p, padm, padp);
+}
 
-    struct timespec start, end;
-    clock_gettime(CLOCK_MONOTONIC, &start);
-    mm(padA, padB, padC, padm, padn, padp, &pool);
-    clock_gettime(CLOCK_MONOTONIC, &end);
+/*
+ * Plans
+ *
+ * 服務裡同樣的幾百種 shape 會被呼叫上百萬次，每次 mm() 都重新分類
+ * shape、選 kernel、算 ring 大小、配 pad 緩衝、產生每個 tile 的 task。
+ * gemm_plan_create() 把這些都做一次存起來（類似 FFTW 的 plan），
+ * gemm_plan_execute() 只剩 pad、逐一把預先做好的 task 推進指定的
+ * queue、unpad。同一個 pool 上 (m, n, p, layout, threads) 相同、而且
+ * 建立時 pool 的 place、stream_c、split_k、deterministic 設定也相同的
+ * plan 只建一次，之後直接回傳快取的那一個；設定改了就另建一個。pool
+ * 銷毀時一起釋放。
+ *
+ * split-K 只看 shape，plan 建立時就照 mm_tiled() 的規則決定，execute 直接
+ * 走 mm_split_k；threads 比 pool 小的 plan 不切 k，免得用到其他 queue。
+ * sparse 與 zero-block 判斷要看資料，plan 一律走 dense 路徑。plan 有自己
+ * 的 pad 緩衝，和 mm() 一樣只能由呼叫端一個 thread 使用。
+ */
+typedef enum {
+    GEMM_ROW_MAJOR,
+    GEMM_COL_MAJOR,     // 以 Cᵀ = Bᵀ·Aᵀ 換成 row-major 的 p×n×m 計算
+} gemm_layout_t;
 
-    #ifndef VALIDATE
-        double elapsed = (end.tv_sec - start.tv_sec) +
-                        (end.tv_nsec - start.tv_nsec) / 1e9;
-        printf("Time: %.6f sec\n", elapsed);
-    #endif
+struct gemm_plan {
+    gemm_plan_t *next;
+    threadpool_t *pool;
+    size_t m, n, p;              // 呼叫端看到的 shape
+    gemm_layout_t layout;
+    size_t threads;              // 用到的 queue 數
+    place_mode_t place;          // pool settings the plan was built under
+    bool stream_c, split_k, deterministic;
+    shape_t shape;
+    size_t ways;                 // split-K ways, 1 = prebuilt tiles
+    size_t rm, rn, rp;           // 實際計算的 row-major shape
+    size_t padm, padn, padp;
+    workspace_t ws;              // pads and tasks, owned by the plan
+    float *padA, *padB, *padC;
+    task_t *tasks;               // prebuilt tiles, in enqueue order
+    size_t *qid;                 // queue of tasks[t]
+    size_t n_tasks;
+    size_t capacity;             // ring slots needed, already a power of two
+};
 
-    #ifdef VALIDATE
-        print_mat(A, m, n);
-        print_mat(B, n, p);
-    #endif
+typedef struct {
+    gemm_plan_t *plan;
+    task_fn kern;
+} plan_fill_t;
 
-    unpad_mat(padC, C, m, p, padm, padp);
+static void plan_add_tile(void *ctx, size_t qid, size_t i, size_t j)
+{
+    plan_fill_t *f = ctx;
+    gemm_plan_t *pl = f->plan;
+    pl->qid[pl->n_tasks] = qid;
+    pl->tasks[pl->n_tasks++] = tile_task(f->kern, pl->padA, pl->padB, pl->padC, pl->padn,
+                                         pl->padp, i * TILE_SIZE, j * TILE_SIZE);
+}
+
+/* threads == 0 或超過 pool 的 worker 數時用整個 pool */
+gemm_plan_t *gemm_plan_create(threadpool_t *pool, size_t m, size_t n, size_t p,
+                              gemm_layout_t layout, size_t threads)
+{
+    if (threads == 0 || threads > pool->num_threads)
+        threads = pool->num_threads;
+    for (gemm_plan_t *pl = pool->plans; pl; pl = pl->next)
+        if (pl->m == m && pl->n == n && pl->p == p && pl->layout == layout &&
+            pl->threads == threads && pl->place == pool->place &&
+            pl->stream_c == pool->stream_c && pl->split_k == pool->split_k &&
+            pl->deterministic == pool->deterministic)
+            return pl;
+
+    gemm_plan_t *pl = calloc(1, sizeof(gemm_plan_t));
+    *pl = (gemm_plan_t){
+        .pool = pool, .m = m, .n = n, .p = p, .layout = layout, .threads = threads,
+        .place = pool->place, .stream_c = pool->stream_c, .split_k = pool->split_k,
+        .deterministic = pool->deterministic, .ways = 1,
+        .rm = layout == GEMM_COL_MAJOR ? p : m, .rn = n,
+        .rp = layout == GEMM_COL_MAJOR ? m : p,
+    };
+    pl->ws.huge = pool->ws.huge;
+    pl->shape = classify_shape(pl->rm, pl->rn, pl->rp);
+    pl->next = pool->plans;
+    pool->plans = pl;
+    if (pl->shape != SHAPE_TILED)
+        return pl;
+
+    pl->padm = ALIGN_UP(pl->rm);
+    pl->padn = ALIGN_UP(pl->rn);
+    pl->padp = ALIGN_UP(pl->rp);
+    pl->padA = ws_alloc(&pl->ws, pl->padm * pl->padn * sizeof(float));
+    pl->padB = ws_alloc(&pl->ws, pl->padp * pl->padn * sizeof(float));
+    pl->padC = ws_alloc(&pl->ws, pl->padm * pl->padp * sizeof(float));
+
+    size_t tm = pl->padm / TILE_SIZE, tp = pl->padp / TILE_SIZE;
+    if (threads == pool->num_threads)
+        pl->ways = split_k_ways(pool, tm * tp, pl->padn);
+    if (pl->ways > 1)
+        return pl;
+    pl->tasks = ws_alloc(&pl->ws, tm * tp * sizeof(task_t));
+    pl->qid = ws_alloc(&pl->ws, tm * tp * sizeof(size_t));
+    pl->capacity = next_two_power(tile_grid_capacity(tm, tp, threads, pool_pair(pool),
+                                                     pool->place));
+
+    plan_fill_t f = {
+        .plan = pl,
+        .kern = pool->stream_c && pl->padm * pl->padp * sizeof(float) > llc_bytes() ?
+                mm_tile_stream : mm_tile,
+    };
+    tile_grid_walk(tm, tp, threads, pool_pair(pool), pool->place, plan_add_tile, &f);
+    return pl;
+}
+
+/* C = A·B，A、B、C 的 layout 與大小都照 plan 建立時的參數 */
+void gemm_plan_execute(const gemm_plan_t *pl, const float *A, const float *B, float *C)
+{
+    threadpool_t *pool = pl->pool;
+    if (pl->layout == GEMM_COL_MAJOR) {
+        const float *t = A;
+        A = B;
+        B = t;
+    }
+    if (pl->shape != SHAPE_TILED) {
+        mm_skinny(A, B, C, pl->rm, pl->rn, pl->rp, pl->shape, pool);
+        return;
+    }
+
+    pad_into(pl->padA, A, pl->rm, pl->rn, pl->padm, pl->padn, NULL);
+    pad_t_into(pl->padB, B, pl->rn, pl->rp, pl->padn, pl->padp, NULL);
+    if (pl->ways > 1) {
+        mm_split_k(pl->padA, pl->padB, pl->padC, pl->padm, pl->padn, pl->padp, pl->ways, pool);
+        unpad_mat(pl->padC, C, pl->rm, pl->rp, pl->padm, pl->padp);
+        return;
+    }
+    if (pl->capacity > pool->queue_high_water)
+        pool_reserve(pool, pl->capacity);
+    for (size_t t = 0; t < pl->n_tasks; t++)
+        enqueue_to(pool, pl->qid[t], pl->tasks[t]);
+    wait_for_completion(pool);
+    unpad_mat(pl->padC, C, pl->rm, pl->rp, pl->padm, pl->padp);
+}
+
+static void plans_release(threadpool_t *pool)
+{
+    while (pool->plans) {
+        gemm_plan_t *pl = pool->plans;
+        pool->plans = pl->next;
+        ws_release(&pl->ws);
+        free(pl);
+    }
+}
+
+/*
+ * Pre-packed B
+ *
+ * 推論時權重 B 固定不變，mm() 卻每次都重新 pad_t_mat。gemm_pack_b()
+ * 先把 B 轉成 mm_tile 直接讀的格式：轉置、pad 到 64 的倍數、64-byte
+ * 對齊的 padp×padn panel，可選擇存成 bfloat16 省一半頻寬。mm_packed()
+ * 之後只需要 pad A。packed_b_save() 把 header + panel 原樣寫進檔案，
+ * packed_b_load() 直接 mmap 回來，服務冷啟動時不必再 pack。
+ */
+typedef enum {
+    PACK_F32,
+    PACK_BF16,      // round-to-nearest-even，只保留 8 bit mantissa
+} pack_prec_t;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t n, p;
+    uint32_t prec;
+    uint8_t reserved[MEM_ALIGNMENT - 28];
+} packed_hdr_t;
+
+typedef struct {
+    size_t n, p;                 // B 原本是 n×p
+    size_t padn, padp;
+    pack_prec_t prec;
+    void *data;                  // padp×padn, float or uint16_t
+    workspace_t ws;              // owns data after gemm_pack_b()
+    uint8_t *map;                // or a read-only file mapping
+    size_t map_len;
+} packed_b_t;
+
+static size_t packed_bytes(const packed_b_t *pb)
+{
+    return pb->padp * pb->padn * (pb->prec == PACK_BF16 ? sizeof(uint16_t) : sizeof(float));
+}
+
+/* NaN 直接截斷並設 quiet bit，否則捨入的進位會溢到 exponent 或 sign，變成 Inf 或 -0 */
+static inline uint16_t to_bf16(float f)
+{
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    if ((u & 0x7fffffff) > 0x7f800000)
+        return (uint16_t)((u >> 16) | 0x40);
+    return (uint16_t)((u + 0x7fff + ((u >> 16) & 1)) >> 16);
+}
+
+packed_b_t *gemm_pack_b(const float *B, size_t n, size_t p, pack_prec_t prec)
+{
+    packed_b_t *pb = calloc(1, sizeof(packed_b_t));
+    *pb = (packed_b_t){
+        .n = n, .p = p, .padn = ALIGN_UP(n), .padp = ALIGN_UP(p), .prec = prec,
+        .ws = {.huge = true},
+    };
+    if (prec == PACK_F32) {
+        pb->data = pad_t_mat(&pb->ws, B, n, p, pb->padn, pb->padp, NULL);
+        return pb;
+    }
+
+    uint16_t *dst = ws_alloc(&pb->ws, packed_bytes(pb));
+    memset(dst, 0, packed_bytes(pb));
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < p; j++)
+            dst[j * pb->padn + i] = to_bf16(B[i * p + j]);
+    pb->data = dst;
+    return pb;
+}
+
+int packed_b_save(const packed_b_t *pb, const char *path)
+{
+    packed_hdr_t hdr = {.magic = PACKED_MAGIC, .version = PACKED_VERSION, .n = pb->n, .p = pb->p,
+                        .prec = pb->prec};
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        write(fd, pb->data, packed_bytes(pb)) != (ssize_t)packed_bytes(pb)) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/*
+ * header 佔 64 byte，mmap 起點又是 page 對齊，所以 panel 一樣是對齊的。
+ * n、p 來自檔案，先確認 padp × padn × elem 不會溢位而且放得進檔案再用。
+ */
+packed_b_t *packed_b_load(const char *path)
+{
+    packed_hdr_t hdr;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 ||
+        pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, PACKED_MAGIC, 4) != 0 || hdr.prec > PACK_BF16) {
+        fprintf(stderr, "%s: not a " PACKED_MAGIC " packed matrix file\n", path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if (hdr.version != PACKED_VERSION) {
+        fprintf(stderr, "%s: unsupported version %u (expected %d)\n", path, hdr.version,
+                PACKED_VERSION);
+        close(fd);
+        return NULL;
+    }
+
+    size_t elem = hdr.prec == PACK_BF16 ? sizeof(uint16_t) : sizeof(float);
+    size_t avail = (size_t)st.st_size - sizeof(hdr);
+    if (hdr.n == 0 || hdr.p == 0 || hdr.n > avail / elem || hdr.p > avail / elem ||
+        ALIGN_UP(hdr.p) > avail / elem / ALIGN_UP(hdr.n)) {
+        fprintf(stderr, "%s: truncated (%llu x %llu)\n", path, (unsigned long long)hdr.n,
+                (unsigned long long)hdr.p);
+        close(fd);
+        return NULL;
+    }
+
+    packed_b_t *pb = calloc(1, sizeof(packed_b_t));
+    *pb = (packed_b_t){
+        .n = hdr.n, .p = hdr.p, .padn = ALIGN_UP(hdr.n), .padp = ALIGN_UP(hdr.p),
+        .prec = hdr.prec,
+    };
+    pb->map_len = sizeof(hdr) + packed_bytes(pb);
+    pb->map = mmap(NULL, pb->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pb->map == MAP_FAILED) {
+        perror("mmap");
+        free(pb);
+        return NULL;
+    }
+    pb->data = pb->map + sizeof(hdr);
+    return pb;
+}
+
+void packed_b_free(packed_b_t *pb)
+{
+    if (pb->map)
+        munmap(pb->map, pb->map_len);
+    ws_release(&pb->ws);
+    free(pb);
+}
+
+typedef struct {
+    task_fn kern;
+    float *A, *C;
+    const packed_b_t *B;
+} packed_grid_t;
+
+/* bf16 的 panel 以 uint16_t 為單位，B 的起點不能照 float 算 */
+static task_t packed_tile(const void *ctx, size_t i, size_t j)
+{
+    const packed_grid_t *g = ctx;
+    size_t padn = g->B->padn, padp = g->B->padp;
+    task_t t = tile_task(g->kern, g->A, g->B->data, g->C, padn, padp,
+                         i * TILE_SIZE, j * TILE_SIZE);
+    if (g->B->prec == PACK_BF16)
+        t.B = (float *)((uint16_t *)g->B->data + j * TILE_SIZE * padn);
+    return t;
+}
+
+/* C (m×p) = A (m×n) · B，B 是 gemm_pack_b() 或 packed_b_load() 的結果 */
+void mm_packed(const float *A, const packed_b_t *B, float *C, size_t m, threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m);
+    ws_reset(&pool->ws);
+    packed_grid_t g = {
+        .A = pad_mat(&pool->ws, A, m, B->n, padm, B->padn, NULL),
+        .C = ws_alloc(&pool->ws, padm * B->padp * sizeof(float)),
+        .B = B,
+    };
+    if (B->prec == PACK_BF16)
+        g.kern = mm_tile_bf16;
+    else
+        g.kern = pool->stream_c && padm * B->padp * sizeof(float) > llc_bytes() ?
+                 mm_tile_stream : mm_tile;
+    enqueue_tile_grid(pool, padm / TILE_SIZE, B->padp / TILE_SIZE, packed_tile, &g);
+    unpad_mat(g.C, C, m, B->p, padm, B->padp);
+}
+
+/*
+ * 多層連乘 X_{l+1} = X_l · W_l（MLP forward）。X_0 是 m×dims[0]，
+ * W_l 是 dims[l]×dims[l+1]。第 l+1 層的 tile (i, j) 只依賴第 l 層
+ * row panel i 的 join node，不必等整層算完。
+ */
+void mm_chain(const float *X, const float *const *W, const size_t *dims,
+              size_t layers, float *Y, size_t m, threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m), tm = padm / TILE_SIZE;
+    ws_reset(&pool->ws);
+
+    size_t max_nodes = 0;
+    for (size_t l = 0; l < layers; l++)
+        max_nodes += tm * (ALIGN_UP(dims[l + 1]) / TILE_SIZE) + tm;
+
+    task_graph_t g;
+    graph_init(&g, &pool->ws, max_nodes);
+
+    float *in = pad_mat(&pool->ws, X, m, dims[0], padm, ALIGN_UP(dims[0]), NULL);
+    task_node_t **prev_join = NULL;
+
+    for (size_t l = 0; l < layers; l++) {
+        size_t padn = ALIGN_UP(dims[l]), padp = ALIGN_UP(dims[l + 1]);
+        size_t tp = padp / TILE_SIZE;
+        size_t next_tp = l + 1 < layers ? ALIGN_UP(dims[l + 2]) / TILE_SIZE : 0;
+        float *wt = pad_t_mat(&pool->ws, W[l], dims[l], dims[l + 1], padn, padp, NULL);
+        float *out = ws_alloc(&pool->ws, padm * padp * sizeof(float));
+        task_node_t **join = ws_alloc(&pool->ws, tm * sizeof(task_node_t *));
+
+        for (size_t i = 0; i < tm; i++) {
+            join[i] = graph_add(&g, (task_t){0}, next_tp);
+            for (size_t j = 0; j < tp; j++) {
+                task_node_t *nd = graph_add(&g, tile_task(mm_tile, in, wt, out, padn, padp,
+                                                          i * TILE_SIZE, j * TILE_SIZE), 1);
+                graph_edge(nd, join[i]);
+                if (prev_join)
+                    graph_edge(prev_join[i], nd);
+            }
+        }
+        in = out;
+        prev_join = join;
+    }
+
+    graph_run(pool, &g);
+    unpad_mat(in, Y, m, dims[layers], padm, ALIGN_UP(dims[layers]));
+}
+
+/*
+ * Symmetric / triangular products
+ *
+ * SYRK (A·Aᵀ) 與 SYR2K (A·Bᵀ + B·Aᵀ) 的結果對稱，只算 uplo 那一半的
+ * tile；TRMM (T·B) 的 T 是三角矩陣，tile (i, j) 只需要 T 非零的那段 k。
+ * 兩者每個 row 的工作量都不一樣，所以不用 2D block，而是把 task 依
+ * 成本切成 num_threads 段連續的區間，每段放進一個 worker 的 queue。
+ */
+typedef enum {
+    UPLO_UPPER,
+    UPLO_LOWER,
+} uplo_t;
+
+/* tasks 依序切成成本相等的 num_threads 段，第 w 段放進 queue w */
+static void enqueue_balanced(threadpool_t *pool, const task_t *tasks, const size_t *cost,
+                             size_t n_tasks)
+{
+    size_t total = 0, acc = 0, T = pool->num_threads;
+    for (size_t t = 0; t < n_tasks; t++)
+        total += cost[t];
+    pool_reserve(pool, ring_capacity(n_tasks, T) * 2);
+
+    for (size_t t = 0; t < n_tasks; t++) {
+        size_t mid = acc + cost[t] / 2;   // 以 task 的中點決定歸屬
+        size_t qid = total ? mid * T / total : 0;
+        enqueue_to(pool, qid < T ? qid : T - 1, tasks[t]);
+        acc += cost[t];
+    }
+    wait_for_completion(pool);
+}
+
+/* C (padm×padm) 的上/下三角 tile = X·Yᵀ，X、Y 都是 padm×padn row-major */
+static void mm_sym_tiles(float *X, float *Y, float *C, size_t padm, size_t padn,
+                         uplo_t uplo, threadpool_t *pool)
+{
+    size_t tm = padm / TILE_SIZE, n_tasks = 0;
+    task_fn kern = pool->stream_c && padm * padm * sizeof(float) > llc_bytes()
+                       ? mm_tile_stream : mm_tile;
+    task_t *tasks = ws_alloc(&pool->ws, tm * (tm + 1) / 2 * sizeof(task_t));
+    size_t *cost = ws_alloc(&pool->ws, tm * (tm + 1) / 2 * sizeof(size_t));
+
+    for (size_t i = 0; i < tm; i++) {
+        size_t j0 = uplo == UPLO_UPPER ? i : 0, j1 = uplo == UPLO_UPPER ? tm : i + 1;
+        for (size_t j = j0; j < j1; j++) {
+            tasks[n_tasks] = tile_task(kern, X, Y, C, padn, padm, i * TILE_SIZE, j * TILE_SIZE);
+            cost[n_tasks++] = 1;
+        }
+    }
+    enqueue_balanced(pool, tasks, cost, n_tasks);
+}
+
+/* 把 pad 過的對稱結果拷回 C；mirror 時另一半用轉置補齊，否則不動 */
+static void unpad_sym(const float *src, float *dst, size_t m, size_t padm,
+                      uplo_t uplo, bool mirror)
+{
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < m; j++) {
+            bool mine = uplo == UPLO_UPPER ? j >= i : j <= i;
+            if (mine)
+                dst[i * m + j] = src[i * padm + j];
+            else if (mirror)
+                dst[i * m + j] = src[j * padm + i];
+        }
+    }
+}
+
+/* C (m×m) = A·Aᵀ，A 是 m×n。pad 後的 A 本身就是 mm_tile 要的「轉置 B」 */
+void syrk(const float *A, float *C, size_t m, size_t n, uplo_t uplo, bool mirror,
+          threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m), padn = ALIGN_UP(n);
+    ws_reset(&pool->ws);
+    float *padA = pad_mat(&pool->ws, A, m, n, padm, padn, NULL);
+    float *padC = ws_alloc(&pool->ws, padm * padm * sizeof(float));
+
+    mm_sym_tiles(padA, padA, padC, padm, padn, uplo, pool);
+    unpad_sym(padC, C, m, padm, uplo, mirror);
+}
+
+/* C (m×m) = A·Bᵀ + B·Aᵀ，A、B 都是 m×n：等於 [A B]·[B A]ᵀ，k 長度變兩倍 */
+void syr2k(const float *A, const float *B, float *C, size_t m, size_t n, uplo_t uplo,
+           bool mirror, threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m), padn = ALIGN_UP(n);
+    ws_reset(&pool->ws);
+    float *X = ws_alloc(&pool->ws, padm * 2 * padn * sizeof(float));
+    float *Y = ws_alloc(&pool->ws, padm * 2 * padn * sizeof(float));
+    memset(X, 0, padm * 2 * padn * sizeof(float));
+    memset(Y, 0, padm * 2 * padn * sizeof(float));
+    for (size_t i = 0; i < m; i++) {
+        memcpy(X + i * 2 * padn, A + i * n, n * sizeof(float));
+        memcpy(X + i * 2 * padn + padn, B + i * n, n * sizeof(float));
+        memcpy(Y + i * 2 * padn, B + i * n, n * sizeof(float));
+        memcpy(Y + i * 2 * padn + padn, A + i * n, n * sizeof(float));
+    }
+    float *padC = ws_alloc(&pool->ws, padm * padm * sizeof(float));
+
+    mm_sym_tiles(X, Y, padC, padm, 2 * padn, uplo, pool);
+    unpad_sym(padC, C, m, padm, uplo, mirror);
+}
+
+/*
+ * C (m×p) = T·B，T 是 m×m 的上/下三角（另一半不讀），B 是 m×p。
+ * 下三角時 tile row i 只需要 k < (i+1)·64，上三角只需要 k ≥ i·64。
+ */
+void trmm(const float *T, const float *B, float *C, size_t m, size_t p, uplo_t uplo,
+          threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m), padp = ALIGN_UP(p);
+    size_t tm = padm / TILE_SIZE, tp = padp / TILE_SIZE, n_tasks = 0;
+    ws_reset(&pool->ws);
+    float *padT = ws_alloc(&pool->ws, padm * padm * sizeof(float));
+    memset(padT, 0, padm * padm * sizeof(float));
+    for (size_t i = 0; i < m; i++) {
+        size_t j0 = uplo == UPLO_UPPER ? i : 0, j1 = uplo == UPLO_UPPER ? m : i + 1;
+        memcpy(padT + i * padm + j0, T + i * m + j0, (j1 - j0) * sizeof(float));
+    }
+    float *padB = pad_t_mat(&pool->ws, B, m, p, padm, padp, NULL);
+    float *padC = ws_alloc(&pool->ws, padm * padp * sizeof(float));
+
+    task_fn kern = pool->stream_c && padm * padp * sizeof(float) > llc_bytes()
+                       ? mm_tile_stream : mm_tile;
+    task_t *tasks = ws_alloc(&pool->ws, tm * tp * sizeof(task_t));
+    size_t *cost = ws_alloc(&pool->ws, tm * tp * sizeof(size_t));
+    for (size_t i = 0; i < tm; i++) {
+        size_t k0 = uplo == UPLO_UPPER ? i * TILE_SIZE : 0;
+        size_t k1 = uplo == UPLO_UPPER ? padm : (i + 1) * TILE_SIZE;
+        for (size_t j = 0; j < tp; j++) {
+            task_t t = tile_task(kern, padT, padB, padC, padm, padp, i * TILE_SIZE, j * TILE_SIZE);
+            t.A += k0;
+            t.B += k0;
+            t.n_k = k1 - k0;
+            tasks[n_tasks] = t;
+            cost[n_tasks++] = (k1 - k0) / TILE_SIZE;
+        }
+    }
+    enqueue_balanced(pool, tasks, cost, n_tasks);
+    unpad_mat(padC, C, m, p, padm, padp);
+}
+
+/*
+ * Convolution (implicit im2col)
+ *
+ * conv2d 就是 Out (K × OH·OW) = W (K × C·R·S) · im2col(In)。im2col 不做成
+ * 一整塊 buffer：每個 task 負責一張圖的 64 個輸出 pixel，在 worker 的
+ * scratch workspace 裡直接從輸入 tensor 組出這 64 個 pixel 的 patch
+ * （就是 mm_tile 要的「轉置 B」panel），再對所有 output channel tile
+ * 重複使用它。NCHW 的 weight 是 KCRS、patch 順序 (c, r, s)；NHWC 的
+ * weight 是 KRSC、patch 順序 (r, s, c)，C 個 channel 可以一次拷。
+ */
+typedef enum {
+    LAYOUT_NCHW,
+    LAYOUT_NHWC,
+} layout_t;
+
+typedef struct {
+    size_t n, c, h, w;       // input
+    size_t k, r, s;          // output channels, filter height/width
+    size_t stride, pad;
+    layout_t layout;
+} conv_shape_t;
+
+typedef struct {
+    const conv_shape_t *sh;
+    const float *in;
+    float *out;
+    float *w;                // padded weights, padk × padkk
+    size_t oh, ow;
+    size_t kk, padkk;        // patch length c·r·s and its padded size
+} conv_t;
+
+typedef struct {
+    const conv_t *cv;
+    size_t img, pix0;        // image and first output pixel of the panel
+    size_t k0, k_tiles;      // output channel tiles handled by this task
+} conv_part_t;
+
+static inline size_t conv_out_dim(size_t in, size_t f, size_t stride, size_t pad)
+{
+    return in + 2 * pad < f ? 0 : (in + 2 * pad - f) / stride + 1;
+}
+
+/* 輸出 pixel [pix0, pix0+64) 的 patch，一個 pixel 一列，超出範圍補 0 */
+static void im2col_panel(const conv_t *cv, size_t img, size_t pix0, float *panel)
+{
+    const conv_shape_t *sh = cv->sh;
+    for (size_t q = 0; q < TILE_SIZE; q++) {
+        float *dst = panel + q * cv->padkk;
+        size_t pix = pix0 + q, kk = 0;
+        if (pix < cv->oh * cv->ow) {
+            long ih0 = (long)(pix / cv->ow * sh->stride) - (long)sh->pad;
+            long iw0 = (long)(pix % cv->ow * sh->stride) - (long)sh->pad;
+            if (sh->layout == LAYOUT_NCHW) {
+                const float *src = cv->in + img * sh->c * sh->h * sh->w;
+                for (size_t c = 0; c < sh->c; c++, src += sh->h * sh->w)
+                    for (size_t r = 0; r < sh->r; r++)
+                        for (size_t s = 0; s < sh->s; s++) {
+                            long ih = ih0 + (long)r, iw = iw0 + (long)s;
+                            bool in = ih >= 0 && ih < (long)sh->h && iw >= 0 && iw < (long)sh->w;
+                            dst[kk++] = in ? src[ih * sh->w + iw] : 0.0f;
+                        }
+            } else {
+                const float *src = cv->in + img * sh->h * sh->w * sh->c;
+                for (size_t r = 0; r < sh->r; r++)
+                    for (size_t s = 0; s < sh->s; s++, kk += sh->c) {
+                        long ih = ih0 + (long)r, iw = iw0 + (long)s;
+                        if (ih >= 0 && ih < (long)sh->h && iw >= 0 && iw < (long)sh->w)
+                            memcpy(dst + kk, src + (ih * sh->w + iw) * sh->c,
+                                   sh->c * sizeof(float));
+                        else
+                            memset(dst + kk, 0, sh->c * sizeof(float));
+                    }
+            }
+        }
+        memset(dst + kk, 0, (cv->padkk - kk) * sizeof(float));
+    }
+}
+
+static void conv_panel(const task_t *task)
+{
+    const conv_part_t *cp = task->arg;
+    const conv_t *cv = cp->cv;
+    const conv_shape_t *sh = cv->sh;
+    size_t ohw = cv->oh * cv->ow;
+    size_t npix = ohw - cp->pix0 < TILE_SIZE ? ohw - cp->pix0 : TILE_SIZE;
+
+    ws_reset(tls_ws);
+    float *panel = ws_alloc(tls_ws, TILE_SIZE * cv->padkk * sizeof(float));
+    float *ctile = ws_alloc(tls_ws, TILE_SIZE * TILE_SIZE * sizeof(float));
+    im2col_panel(cv, cp->img, cp->pix0, panel);
+
+    for (size_t t = 0; t < cp->k_tiles; t++) {
+        size_t k0 = cp->k0 + t * TILE_SIZE;
+        size_t nk = sh->k - k0 < TILE_SIZE ? sh->k - k0 : TILE_SIZE;
+        task_t tile = {
+            .A = cv->w + k0 * cv->padkk,
+            .B = panel,
+            .C = ctile,
+            .stride_a = cv->padkk,
+            .stride_b = cv->padkk,
+            .stride_c = TILE_SIZE,
+            .n_k = cv->padkk,
+        };
+        mm_tile(&tile);
+
+        /* ctile[k][q]：NCHW 每個 channel 一段連續 pixel，NHWC 每個 pixel 一段 channel */
+        if (sh->layout == LAYOUT_NCHW) {
+            float *dst = cv->out + (cp->img * sh->k + k0) * ohw + cp->pix0;
+            for (size_t k = 0; k < nk; k++)
+                memcpy(dst + k * ohw, ctile + k * TILE_SIZE, npix * sizeof(float));
+        } else {
+            float *dst = cv->out + (cp->img * ohw + cp->pix0) * sh->k + k0;
+            for (size_t q = 0; q < npix; q++)
+                for (size_t k = 0; k < nk; k++)
+                    dst[q * sh->k + k] = ctile[k * TILE_SIZE + q];
+        }
+    }
+}
+
+/* out = conv2d(in, weights)，沒有 bias。輸出大小 conv_out_dim() */
+void conv2d(const float *in, const float *weights, float *out, const conv_shape_t *sh,
+            threadpool_t *pool)
+{
+    conv_t cv = {
+        .sh = sh,
+        .in = in,
+        .out = out,
+        .oh = conv_out_dim(sh->h, sh->r, sh->stride, sh->pad),
+        .ow = conv_out_dim(sh->w, sh->s, sh->stride, sh->pad),
+        .kk = sh->c * sh->r * sh->s,
+    };
+    cv.padkk = ALIGN_UP(cv.kk);
+    size_t ohw = cv.oh * cv.ow, padk = ALIGN_UP(sh->k);
+    size_t panels = (ohw + TILE_SIZE - 1) / TILE_SIZE, k_tiles = padk / TILE_SIZE;
+    if (!ohw || !sh->n || !sh->k)
+        return;
+
+    ws_reset(&pool->ws);
+    cv.w = pad_mat(&pool->ws, weights, sh->k, cv.kk, padk, cv.padkk, NULL);
+
+    /* pixel panel 不夠分給每個 worker 時，再沿 output channel 切 */
+    size_t groups = 1, base = sh->n * panels;
+    while (base * groups < 2 * pool->num_threads && groups < k_tiles)
+        groups++;
+    size_t per = (k_tiles + groups - 1) / groups;
+    groups = (k_tiles + per - 1) / per;
+
+    size_t n_tasks = base * groups;
+    conv_part_t *parts = ws_alloc(&pool->ws, n_tasks * sizeof(conv_part_t));
+    pool_reserve(pool, ring_capacity(n_tasks, pool->num_threads));
+    for (size_t t = 0; t < n_tasks; t++) {
+        size_t g = t % groups, pi = t / groups;
+        parts[t] = (conv_part_t){
+            .cv = &cv,
+            .img = pi / panels,
+            .pix0 = pi % panels * TILE_SIZE,
+            .k0 = g * per * TILE_SIZE,
+            .k_tiles = g + 1 < groups ? per : k_tiles - g * per,
+        };
+        enqueue(pool, (task_t){.run = conv_panel, .arg = &parts[t]});
+    }
+    wait_for_completion(pool);
+}
+
+/*
+ * Complex GEMM
+ *
+ * 複數以 (re, im) 交錯存放，一個 __m256 裝 4 個複數。對每個 k 把
+ * A[i][k] 的實部、虛部各 broadcast 一次，分別乘上同一個 B 向量累加：
+ *   acc_r += a.re · (b.re, b.im)    acc_i += a.im · (b.re, b.im)
+ * 迴圈裡沒有 shuffle，最後把 acc_i 兩兩對調，用 fmaddsub 合成
+ *   (Σ a.re·b.re − a.im·b.im, Σ a.re·b.im + a.im·b.re)。
+ * Tile 是 64×64 個複數，排程和實數 mm_tiled 共用 enqueue_tile_grid()。
+ */
+#define CMR 2    // micro-tile：2 列 × 2 個 __m256（8 個複數）
+
+static inline __m256 cplx_combine(__m256 acc_r, __m256 acc_i)
+{
+    return _mm256_fmaddsub_ps(acc_r, _mm256_set1_ps(1.0f), _mm256_permute_ps(acc_i, 0xB1));
+}
+
+/* A 是 row panel (stride_a floats)，B 是 row-major 的 column panel，n_k 是複數個數 */
+static void ctile(const task_t *task)
+{
+    const size_t sa = task->stride_a, sb = task->stride_b, sc = task->stride_c;
+    for (size_t ti = 0; ti < TILE_SIZE; ti += CMR) {
+        const float *a0 = task->A + ti * sa, *a1 = a0 + sa;
+        for (size_t tj = 0; tj < 2 * TILE_SIZE; tj += 16) {
+            __m256 r00 = _mm256_setzero_ps(), r01 = _mm256_setzero_ps();
+            __m256 i00 = _mm256_setzero_ps(), i01 = _mm256_setzero_ps();
+            __m256 r10 = _mm256_setzero_ps(), r11 = _mm256_setzero_ps();
+            __m256 i10 = _mm256_setzero_ps(), i11 = _mm256_setzero_ps();
+
+            for (size_t k = 0; k < task->n_k; k++) {
+                const float *b = task->B + k * sb + tj;
+                __m256 b0 = _mm256_loadu_ps(b), b1 = _mm256_loadu_ps(b + 8);
+                __m256 ar = _mm256_set1_ps(a0[2 * k]), ai = _mm256_set1_ps(a0[2 * k + 1]);
+                r00 = _mm256_fmadd_ps(ar, b0, r00);
+                r01 = _mm256_fmadd_ps(ar, b1, r01);
+                i00 = _mm256_fmadd_ps(ai, b0, i00);
+                i01 = _mm256_fmadd_ps(ai, b1, i01);
+                ar = _mm256_set1_ps(a1[2 * k]);
+                ai = _mm256_set1_ps(a1[2 * k + 1]);
+                r10 = _mm256_fmadd_ps(ar, b0, r10);
+                r11 = _mm256_fmadd_ps(ar, b1, r11);
+                i10 = _mm256_fmadd_ps(ai, b0, i10);
+                i11 = _mm256_fmadd_ps(ai, b1, i11);
+            }
+
+            float *c0 = task->C + ti * sc + tj, *c1 = c0 + sc;
+            _mm256_storeu_ps(c0, cplx_combine(r00, i00));
+            _mm256_storeu_ps(c0 + 8, cplx_combine(r01, i01));
+            _mm256_storeu_ps(c1, cplx_combine(r10, i10));
+            _mm256_storeu_ps(c1 + 8, cplx_combine(r11, i11));
+        }
+    }
+}
+
+typedef struct {
+    float *A, *B, *C;
+    size_t padn, padp;
+} cplx_grid_t;
+
+static task_t cplx_tile(const void *ctx, size_t i, size_t j)
+{
+    const cplx_grid_t *g = ctx;
+    return (task_t){
+        .run = ctile,
+        .A = g->A + i * TILE_SIZE * 2 * g->padn,
+        .B = g->B + j * TILE_SIZE * 2,
+        .C = g->C + i * TILE_SIZE * 2 * g->padp + j * TILE_SIZE * 2,
+        .stride_a = 2 * g->padn,
+        .stride_b = 2 * g->padp,
+        .stride_c = 2 * g->padp,
+        .n_k = g->padn,
+    };
+}
+
+/* C (m×p) = A (m×n) · B (n×p)，三者都是交錯的 complex float */
+void cgemm(const float *A, const float *B, float *C, size_t m, size_t n, size_t p,
+           threadpool_t *pool)
+{
+    size_t padm = ALIGN_UP(m), padn = ALIGN_UP(n), padp = ALIGN_UP(p);
+    ws_reset(&pool->ws);
+    cplx_grid_t g = {
+        .A = pad_mat(&pool->ws, A, m, 2 * n, padm, 2 * padn, NULL),
+        .B = pad_mat(&pool->ws, B, n, 2 * p, padn, 2 * padp, NULL),
+        .C = ws_alloc(&pool->ws, padm * 2 * padp * sizeof(float)),
+        .padn = padn,
+        .padp = padp,
+    };
+    enqueue_tile_grid(pool, padm / TILE_SIZE, padp / TILE_SIZE, cplx_tile, &g);
+    unpad_mat(g.C, C, m, 2 * p, padm, 2 * padp);
+}
+
+/*
+ * Asynchronous submission
+ *
+ * gemm_submit() 只建好一張 graph 就回傳：pad A 的 row panel、pad B 的
+ * column panel、tile、把 C 的 row panel 拷回去，全部都是 pool 上的 task。
+ * 最後一個 task 做完時由那條 worker 通知：寫 eventfd（給 epoll loop）、
+ * 呼叫 callback（在 worker thread 上執行，要短）、喚醒 gemm_wait()。
+ * job 物件連同它的 workspace 由 pool 回收重用。
+ */
+static void pack_rows(const task_t *task)
+{
+    for (size_t i = 0; i < TILE_SIZE; i++) {
+        float *dst = task->C + i * task->stride_c;
+        size_t valid = i < task->rows ? task->cols : 0;
+        if (valid)
+            memcpy(dst, task->A + i * task->stride_a, valid * sizeof(float));
+        memset(dst + valid, 0, (task->stride_c - valid) * sizeof(float));
+    }
+}
+
+/* B 的一個 column panel 轉置成 TILE_SIZE 條長度 stride_c 的 row */
+static void pack_cols_t(const task_t *task)
+{
+    for (size_t k = 0; k < task->rows; k++) {
+        const float *src = task->A + k * task->stride_a;
+        for (size_t j = 0; j < task->cols; j++)
+            task->C[j * task->stride_c + k] = src[j];
+    }
+    for (size_t j = 0; j < TILE_SIZE; j++) {
+        size_t valid = j < task->cols ? task->rows : 0;
+        memset(task->C + j * task->stride_c + valid, 0,
+               (task->stride_c - valid) * sizeof(float));
+    }
+}
+
+static void unpad_rows(const task_t *task)
+{
+    for (size_t i = 0; i < task->rows; i++)
+        memcpy(task->C + i * task->stride_c, task->A + i * task->stride_a,
+               task->cols * sizeof(float));
+}
+
+static gemm_job_t *job_get(threadpool_t *pool)
+{
+    pthread_mutex_lock(&pool->job_lock);
+    gemm_job_t *job = pool->free_jobs;
+    if (job)
+        pool->free_jobs = job->next_free;
+    pthread_mutex_unlock(&pool->job_lock);
+
+    if (!job) {
+        job = calloc(1, sizeof(gemm_job_t));
+        job->ws.huge = pool->ws.huge;
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->cond, NULL);
+    }
+    job->pool = pool;
+    atomic_store(&job->done, false);
+    ws_reset(&job->ws);
+    return job;
+}
+
+/* 完成之後（callback 裡或 gemm_wait / eventfd 之後）把 job 還給 pool */
+void gemm_job_release(gemm_job_t *job)
+{
+    threadpool_t *pool = job->pool;
+    pthread_mutex_lock(&pool->job_lock);
+    job->next_free = pool->free_jobs;
+    pool->free_jobs = job;
+    pthread_mutex_unlock(&pool->job_lock);
+}
+
+static void jobs_release(threadpool_t *pool)
+{
+    while (pool->free_jobs) {
+        gemm_job_t *job = pool->free_jobs;
+        pool->free_jobs = job->next_free;
+        ws_release(&job->ws);
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->cond);
+        free(job);
+    }
+}
+
+static void job_task_done(gemm_job_t *job)
+{
+    if (atomic_fetch_sub_explicit(&job->remaining, 1, memory_order_acq_rel) != 1)
+        return;
+
+    /* 喚醒之後 job 可能馬上被 release，先把通知對象拷出來 */
+    gemm_callback_t cb = job->cb;
+    void *user = job->user;
+    int efd = job->efd;
+
+    pthread_mutex_lock(&job->lock);
+    atomic_store(&job->done, true);
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    if (efd >= 0) {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) != sizeof(one))
+            perror("eventfd write");
+    }
+    if (cb)
+        cb(job, user);
+}
+
+void gemm_wait(gemm_job_t *job)
+{
+    pthread_mutex_lock(&job->lock);
+    while (!atomic_load(&job->done))
+        pthread_cond_wait(&job->cond, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+}
+
+bool gemm_done(const gemm_job_t *job)
+{
+    return atomic_load(&job->done);
+}
+
+/*
+ * 非阻塞的 C = A · B。A/B/C 在完成通知之前都不能動。efd < 0 表示
+ * 不用 eventfd，cb == NULL 表示不用 callback。job 的每個 task 都帶 prio，
+ * PRIO_HIGH 的 job 會插隊到所有 PRIO_NORMAL 的 task 前面。
+ */
+gemm_job_t *gemm_submit_prio(threadpool_t *pool, prio_t prio,
+                             const float *A, const float *B, float *C,
+                             size_t m, size_t n, size_t p,
+                             gemm_callback_t cb, void *user, int efd)
+{
+    gemm_job_t *job = job_get(pool);
+    job->cb = cb;
+    job->user = user;
+    job->efd = efd;
+
+    size_t padm = ALIGN_UP(m), padn = ALIGN_UP(n), padp = ALIGN_UP(p);
+    size_t tm = padm / TILE_SIZE, tp = padp / TILE_SIZE;
+    float *padA = ws_alloc(&job->ws, padm * padn * sizeof(float));
+    float *padB = ws_alloc(&job->ws, padp * padn * sizeof(float));
+    float *padC = ws_alloc(&job->ws, padm * padp * sizeof(float));
+    task_fn kern = pool->stream_c && padm * padp * sizeof(float) > llc_bytes()
+                       ? mm_tile_stream : mm_tile;
+
+    size_t n_nodes = tm + tp + tm * tp + tm;
+    task_graph_t *g = &job->graph;
+    graph_init(g, &job->ws, n_nodes);
+    atomic_store(&job->remaining, (int)n_nodes);
+
+    task_node_t **pa = ws_alloc(&job->ws, tm * sizeof(task_node_t *));
+    task_node_t **pb = ws_alloc(&job->ws, tp * sizeof(task_node_t *));
+    task_node_t **out = ws_alloc(&job->ws, tm * sizeof(task_node_t *));
+
+    for (size_t i = 0; i < tm; i++) {
+        size_t rows = m - i * TILE_SIZE < TILE_SIZE ? m - i * TILE_SIZE : TILE_SIZE;
+        pa[i] = graph_add(g, (task_t){
+            .run = pack_rows, .A = (float *)A + i * TILE_SIZE * n,
+            .C = padA + i * TILE_SIZE * padn, .stride_a = n, .stride_c = padn,
+            .rows = rows, .cols = n, .job = job, .prio = prio}, tp);
+        out[i] = graph_add(g, (task_t){
+            .run = unpad_rows, .A = padC + i * TILE_SIZE * padp,
+            .C = C + i * TILE_SIZE * p, .stride_a = padp, .stride_c = p,
+            .rows = rows, .cols = p, .job = job, .prio = prio}, 0);
+    }
+    for (size_t j = 0; j < tp; j++) {
+        size_t cols = p - j * TILE_SIZE < TILE_SIZE ? p - j * TILE_SIZE : TILE_SIZE;
+        pb[j] = graph_add(g, (task_t){
+            .run = pack_cols_t, .A = (float *)B + j * TILE_SIZE,
+            .C = padB + j * TILE_SIZE * padn, .stride_a = p, .stride_c = padn,
+            .rows = n, .cols = cols, .job = job, .prio = prio}, tm);
+    }
+    for (size_t i = 0; i < tm; i++) {
+        for (size_t j = 0; j < tp; j++) {
+            task_t t = tile_task(kern, padA, padB, padC, padn, padp,
+                                 i * TILE_SIZE, j * TILE_SIZE);
+            t.job = job;
+            t.prio = prio;
+            task_node_t *nd = graph_add(g, t, 1);
+            graph_edge(pa[i], nd);
+            graph_edge(pb[j], nd);
+            graph_edge(nd, out[i]);
+        }
+    }
+
+    graph_launch(pool, g);
+    return job;
+}
+
+gemm_job_t *gemm_submit(threadpool_t *pool,
+                        const float *A, const float *B, float *C,
+                        size_t m, size_t n, size_t p,
+                        gemm_callback_t cb, void *user, int efd)
+{
+    return gemm_submit_prio(pool, PRIO_NORMAL, A, B, C, m, n, p, cb, user, efd);
+}
+
+/*
+ * --async 的示範：像 event loop 一樣把 eventfd 掛在 epoll 上，
+ * 等待期間 loop 仍在轉（每圈 1 ms timeout），回傳轉了幾圈。
+ */
+static size_t mm_async_epoll(const float *A, const float *B, float *C,
+                             size_t m, size_t n, size_t p, threadpool_t *pool)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (efd < 0 || ep < 0) {
+        perror("eventfd/epoll");
+        exit(1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = efd};
+    epoll_ctl(ep, EPOLL_CTL_ADD, efd, &ev);
+
+    gemm_job_t *job = gemm_submit(pool, A, B, C, m, n, p, NULL, NULL, efd);
+    size_t ticks = 0;
+    for (;;) {
+        if (epoll_wait(ep, &ev, 1, 1) > 0 && ev.data.fd == efd) {
+            uint64_t cnt;
+            if (read(efd, &cnt, sizeof(cnt)) == sizeof(cnt))
+                break;
+        }
+        ticks++;
+    }
+    gemm_job_release(job);
+    close(ep);
+    close(efd);
+    return ticks;
+}
+
+void fill_rand(float *arr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        arr[i] = (float)rand() / RAND_MAX;
+}
+
+/* 隨機把 64×64 block 整塊清成 0，只留 pct% */
+void zero_blocks(float *arr, size_t rows, size_t cols, size_t pct)
+{
+    for (size_t bi = 0; bi < rows; bi += TILE_SIZE)
+        for (size_t bj = 0; bj < cols; bj += TILE_SIZE) {
+            if ((size_t)rand() % 100 < pct)
+                continue;
+            for (size_t i = bi; i < rows && i < bi + TILE_SIZE; i++)
+                for (size_t j = bj; j < cols && j < bj + TILE_SIZE; j++)
+                    arr[i * cols + j] = 0.0f;
+        }
+}
+
+size_t parse_int(const char *s)
+{
+    return strtoul(s, NULL, 10);
+}
+/* FNV-1a over the raw float bits, to compare results bit for bit */
+static uint64_t hash_bits(const float *x, size_t len)
+{
+    const uint8_t *b = (const uint8_t *)x;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len * sizeof(float); i++)
+        h = (h ^ b[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+void print_mat(const float *mat, size_t m, size_t n)
+{
+    for (size_t i = 0; i < m; i++) {
+        for (size_t j = 0; j < n; j++) {
+            printf("%.6f", mat[i * n + j]);
+            if (j < n - 1)
+                printf(", ");
+        }
+        printf("\n");
+    }
+    printf("---\n");
+}
+/*
+ * Out-of-core streaming mode
+ *
+ * 檔案格式：64-byte header (magic "GEMM", rows, cols) 之後接 row-major float。
+ * A/B/C 都用 mmap 存取；每次只把一個 A row panel 與一個 B column panel
+ * pad 到記憶體裡算一個 C block，算完立刻寫回 C 並把用過的 page 丟掉，
+ * 所以 peak RSS 由 budget 決定而不是矩陣大小。
+ */
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t rows, cols;
+    uint8_t reserved[MEM_ALIGNMENT - 24];
+} mat_hdr_t;
+
+typedef struct {
+    int fd;
+    uint8_t *map;       // whole file mapping
+    size_t map_len;
+    float *data;        // first element after header
+    size_t rows, cols;
+} mat_file_t;
+
+/* 對 [addr, addr+len) 所在的 page 做 madvise（起點往下對齊到 page） */
+static void advise_range(const void *addr, size_t len, int advice)
+{
+    uintptr_t start = (uintptr_t)addr & ~(page_size() - 1);
+    uintptr_t end = (uintptr_t)addr + len;
+    if (end > start)
+        madvise((void *)start, end - start, advice);
+}
+
+static int mat_file_open(mat_file_t *f, const char *path)
+{
+    struct stat st;
+    mat_hdr_t hdr;
+
+    f->fd = open(path, O_RDONLY);
+    if (f->fd < 0 || fstat(f->fd, &st) != 0 ||
+        pread(f->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, MAT_MAGIC, 4) != 0) {
+        fprintf(stderr, "%s: not a " MAT_MAGIC " matrix file\n", path);
+        return -1;
+    }
+    f->rows = hdr.rows;
+    f->cols = hdr.cols;
+    f->map_len = sizeof(hdr) + f->rows * f->cols * sizeof(float);
+    if ((size_t)st.st_size < f->map_len) {
+        fprintf(stderr, "%s: truncated (%zu x %zu)\n", path, f->rows, f->cols);
+        return -1;
+    }
+    f->map = mmap(NULL, f->map_len, PROT_READ, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    f->data = (float *)(f->map + sizeof(hdr));
+    return 0;
+}
+
+static int mat_file_create(mat_file_t *f, const char *path, size_t rows, size_t cols)
+{
+    mat_hdr_t hdr = {.magic = MAT_MAGIC, .version = 1, .rows = rows, .cols = cols};
+
+    f->rows = rows;
+    f->cols = cols;
+    f->map_len = sizeof(hdr) + rows * cols * sizeof(float);
+    f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (f->fd < 0 || ftruncate(f->fd, (off_t)f->map_len) != 0 ||
+        pwrite(f->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+        perror(path);
+        return -1;
+    }
+    f->map = mmap(NULL, f->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, 0);
+    if (f->map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    f->data = (float *)(f->map + sizeof(hdr));
+    return 0;
+}
+
+static void mat_file_close(mat_file_t *f)
+{
+    if (f->map && f->map != MAP_FAILED)
+        munmap(f->map, f->map_len);
+    if (f->fd >= 0)
+        close(f->fd);
+}
+
+/* 產生隨機矩陣檔，給 --stream 測試用 */
+static int mat_file_write_rand(const char *path, size_t rows, size_t cols)
+{
+    mat_file_t f = {.fd = -1};
+    if (mat_file_create(&f, path, rows, cols) != 0)
+        return -1;
+    for (size_t i = 0; i < rows; i++) {
+        fill_rand(f.data + i * cols, cols);
+        advise_range(f.data + i * cols, cols * sizeof(float), MADV_DONTNEED);
+    }
+    mat_file_close(&f);
+    return 0;
+}
+
+typedef struct {
+    size_t mb, pb;        // padded panel height of A / width of B
+    size_t a_panels, b_panels;
+    bool outer_a;         // true: A row panel 在外層，A 只讀一次
+} stream_plan_t;
+
+/*
+ * 這組 panel 大小實際佔的記憶體：三個 buffer 是同一個 workspace chunk，
+ * 要照 page_alloc 的粒度（可能是 2 MB）進位；mm_tiled 改切 k 時另有
+ * ways 份 partial C；pack 與寫回時 mapping 上還有 TILE_SIZE 列在 RSS 裡
+ * （B、C 每列只碰 panel 那段，最多多一個 page）。
+ */
+static size_t stream_bytes(const stream_plan_t *pl, const threadpool_t *pool, size_t n,
+                           size_t p)
+{
+    size_t padn = ALIGN_UP(n);
+    size_t bytes = page_round(((pl->mb + pl->pb) * padn + pl->mb * pl->pb) * sizeof(float),
+                              pool->ws.huge);
+    size_t ways = split_k_ways(pool, (pl->mb / TILE_SIZE) * (pl->pb / TILE_SIZE), padn);
+    if (ways > 1)
+        bytes += page_round(ways * pl->mb * pl->pb * sizeof(float), pool->split_ws.huge);
+
+    size_t seg = page_round(pl->pb * sizeof(float), false) + page_size();
+    size_t row_bc = seg < page_round(p * sizeof(float), false) ? seg
+                                                             : page_round(p * sizeof(float), false);
+    bytes += TILE_SIZE * (page_round(n * sizeof(float), false) + page_size() + 2 * row_bc);
+    return bytes;
+}
+
+/*
+ * 在 budget 內挑 panel 大小：B panel (padn × pb) + A panel (mb × padn)
+ * + C block (mb × pb)。B 整個放得下就常駐，否則 B 佔一半 budget。
+ * 加上進位、partial 與 mapping 後超過 budget 就把 mb、pb 中較大的那個
+ * 縮一個 tile，直到放得下。外層走重讀成本較小的那個方向。
+ */
+static int stream_plan(stream_plan_t *pl, const threadpool_t *pool, size_t m, size_t n,
+                       size_t p, size_t budget)
+{
+    size_t padn = ALIGN_UP(n), padm = ALIGN_UP(m), padp = ALIGN_UP(p);
+    size_t row = padn * sizeof(float);
+
+    pl->pb = padp;
+    if (row * pl->pb > budget / 2)
+        pl->pb = (budget / 2 / row) & ~(size_t)(TILE_SIZE - 1);
+    if (pl->pb < TILE_SIZE || row * pl->pb >= budget)
+        return -1;
+
+    pl->mb = (budget - row * pl->pb) / (row + pl->pb * sizeof(float));
+    pl->mb &= ~(size_t)(TILE_SIZE - 1);
+    if (pl->mb > padm)
+        pl->mb = padm;
+    if (pl->mb < TILE_SIZE)
+        return -1;
+
+    while (stream_bytes(pl, pool, n, p) > budget) {
+        size_t *dim = pl->mb >= pl->pb ? &pl->mb : &pl->pb;
+        if (*dim == TILE_SIZE)
+            dim = dim == &pl->mb ? &pl->pb : &pl->mb;
+        if (*dim == TILE_SIZE)
+            return -1;
+        *dim -= TILE_SIZE;
+    }
+
+    pl->a_panels = (padm + pl->mb - 1) / pl->mb;
+    pl->b_panels = (padp + pl->pb - 1) / pl->pb;
+    /* outer A: B 被讀 a_panels 次；outer B: A 被讀 b_panels 次 */
+    pl->outer_a = (double)p * (pl->a_panels - 1) <= (double)m * (pl->b_panels - 1);
+    return 0;
+}
+
+/* A 的 rows [i0, i0+rows) → mb × padn，每 TILE_SIZE rows 丟一次 mapping 上的 page */
+static void stream_pack_a(float *dst, const mat_file_t *a, size_t i0, size_t mb, size_t padn)
+{
+    size_t rows = a->rows - i0 < mb ? a->rows - i0 : mb;
+    const float *src = a->data + i0 * a->cols;
+
+    memset(dst, 0, mb * padn * sizeof(float));
+    for (size_t r0 = 0; r0 < rows; r0 += TILE_SIZE) {
+        size_t r1 = r0 + TILE_SIZE < rows ? r0 + TILE_SIZE : rows;
+        for (size_t i = r0; i < r1; i++)
+            memcpy(dst + i * padn, src + i * a->cols, a->cols * sizeof(float));
+        advise_range(src + r0 * a->cols, (r1 - r0) * a->cols * sizeof(float), MADV_DONTNEED);
+    }
+}
+
+/* B 的 columns [j0, j0+pb) 轉置成 pb × padn，每 TILE_SIZE rows 丟一次 page */
+static void stream_pack_b(float *dst, const mat_file_t *b, size_t j0, size_t pb, size_t padn)
+{
+    size_t cols = b->cols - j0 < pb ? b->cols - j0 : pb;
+
+    memset(dst, 0, pb * padn * sizeof(float));
+    for (size_t k0 = 0; k0 < b->rows; k0 += TILE_SIZE) {
+        size_t k1 = k0 + TILE_SIZE < b->rows ? k0 + TILE_SIZE : b->rows;
+        for (size_t k = k0; k < k1; k++) {
+            const float *row = b->data + k * b->cols + j0;
+            for (size_t j = 0; j < cols; j++)
+                dst[j * padn + k] = row[j];
+        }
+        advise_range(b->data + k0 * b->cols, (k1 - k0) * b->cols * sizeof(float),
+                     MADV_DONTNEED);
+    }
+}
+
+/* 把算好的 C block 寫回檔案，每 TILE_SIZE rows 釋放一次這段 mapping */
+static void stream_store_c(mat_file_t *c, const float *blk, size_t i0, size_t j0,
+                           size_t mb, size_t pb)
+{
+    size_t rows = c->rows - i0 < mb ? c->rows - i0 : mb;
+    size_t cols = c->cols - j0 < pb ? c->cols - j0 : pb;
+    float *dst = c->data + i0 * c->cols + j0;
+
+    for (size_t r0 = 0; r0 < rows; r0 += TILE_SIZE) {
+        size_t r1 = r0 + TILE_SIZE < rows ? r0 + TILE_SIZE : rows;
+        for (size_t i = r0; i < r1; i++)
+            memcpy(dst + i * c->cols, blk + i * pb, cols * sizeof(float));
+        advise_range(dst + r0 * c->cols, ((r1 - r0 - 1) * c->cols + cols) * sizeof(float),
+                     MADV_DONTNEED);
+    }
+}
+
+/* 預先讓 kernel 把下一個要 pack 的 panel 讀進 page cache（非同步） */
+static void stream_prefetch(const mat_file_t *a, const mat_file_t *b,
+                            const stream_plan_t *pl, size_t ia, size_t jb,
+                            size_t cur_a, size_t cur_b)
+{
+    if (ia != cur_a && ia * pl->mb < a->rows) {
+        size_t rows = a->rows - ia * pl->mb < pl->mb ? a->rows - ia * pl->mb : pl->mb;
+        advise_range(a->data + ia * pl->mb * a->cols, rows * a->cols * sizeof(float),
+                     MADV_WILLNEED);
+    }
+    /* B 的 column panel 在檔案裡是每個 row 的一段，只對這些段 advise；
+     * 整個 B 都叫進來會超出 budget，B 比 RAM 大時還沒用到就被踢掉。
+     * 相鄰 row 的段落在同一個或相連的 page 時併成一次 madvise。 */
+    if (jb != cur_b && jb * pl->pb < b->cols) {
+        size_t j0 = jb * pl->pb, cols = b->cols - j0 < pl->pb ? b->cols - j0 : pl->pb;
+        uintptr_t ps = page_size(), lo = 0, hi = 0;
+        for (size_t k = 0; k < b->rows; k++) {
+            uintptr_t s = (uintptr_t)(b->data + k * b->cols + j0) & ~(ps - 1);
+            uintptr_t e = (uintptr_t)(b->data + k * b->cols + j0 + cols);
+            if (k > 0 && s <= hi) {
+                hi = e;
+                continue;
+            }
+            if (k > 0)
+                advise_range((void *)lo, hi - lo, MADV_WILLNEED);
+            lo = s;
+            hi = e;
+        }
+        advise_range((void *)lo, hi - lo, MADV_WILLNEED);
+    }
+}
+
+int mm_stream(const char *path_a, const char *path_b, const char *path_c,
+              size_t budget)
+{
+    mat_file_t a = {.fd = -1}, b = {.fd = -1}, c = {.fd = -1};
+    stream_plan_t pl;
+    threadpool_t pool;
+    int ret = -1;
+
+    if (mat_file_open(&a, path_a) != 0 || mat_file_open(&b, path_b) != 0)
+        goto out;
+    if (a.cols != b.rows) {
+        fprintf(stderr, "shape mismatch: A is %zux%zu, B is %zux%zu\n",
+                a.rows, a.cols, b.rows, b.cols);
+        goto out;
+    }
+
+    size_t m = a.rows, n = a.cols, p = b.cols, padn = ALIGN_UP(n);
+    init_thread_pool(&pool, pool_default_threads(TOPO_CORES), STEAL_CHUNK + 1, TOPO_CORES);
+    if (stream_plan(&pl, &pool, m, n, p, budget) != 0) {
+        fprintf(stderr, "budget of %zu MB is too small for n=%zu\n", budget >> 20, n);
+        goto done;
+    }
+    if (mat_file_create(&c, path_c, m, p) != 0)
+        goto done;
+    madvise(a.map, a.map_len, MADV_SEQUENTIAL);
+
+    /* 三個 buffer 一次配，stream_bytes 只算一次進位 */
+    float *panA = ws_alloc(&pool.ws, ((pl.mb + pl.pb) * padn + pl.mb * pl.pb) * sizeof(float));
+    float *panB = panA + pl.mb * padn;
+    float *blkC = panB + pl.pb * padn;
+
+    size_t n_outer = pl.outer_a ? pl.a_panels : pl.b_panels;
+    size_t n_inner = pl.outer_a ? pl.b_panels : pl.a_panels;
+    size_t cur_a = SIZE_MAX, cur_b = SIZE_MAX;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t o = 0; o < n_outer; o++) {
+        for (size_t in = 0; in < n_inner; in++) {
+            size_t ia = pl.outer_a ? o : in, jb = pl.outer_a ? in : o;
+
+            if (ia != cur_a)
+                stream_pack_a(panA, &a, ia * pl.mb, pl.mb, padn);
+            if (jb != cur_b)
+                stream_pack_b(panB, &b, jb * pl.pb, pl.pb, padn);
+
+            /* 下一輪要換的 panel 先叫 kernel 去讀 */
+            size_t nx = o * n_inner + in + 1;
+            if (nx < n_outer * n_inner) {
+                size_t no = nx / n_inner, ni = nx % n_inner;
+                stream_prefetch(&a, &b, &pl, pl.outer_a ? no : ni,
+                                pl.outer_a ? ni : no, ia, jb);
+            }
+            cur_a = ia;
+            cur_b = jb;
+
+            mm_tiled(panA, panB, blkC, pl.mb, padn, pl.pb, NULL, NULL, &pool);
+            stream_store_c(&c, blkC, ia * pl.mb, jb * pl.pb, pl.mb, pl.pb);
+        }
+    }
+    msync(c.map, c.map_len, MS_SYNC);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    #ifndef VALIDATE
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                        (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Time: %.6f sec\n", elapsed);
+        printf("Panels: %zu x %zu (mb=%zu, pb=%zu, outer=%s), planned %zu KB, peak RSS: %ld MB\n",
+               pl.a_panels, pl.b_panels, pl.mb, pl.pb, pl.outer_a ? "A" : "B",
+               stream_bytes(&pl, &pool, n, p) >> 10, ru.ru_maxrss >> 10);
+    #endif
+
+    ret = 0;
+done:
+    destroy_thread_pool(&pool);
+out:
+    mat_file_close(&a);
+    mat_file_close(&b);
+    mat_file_close(&c);
+    return ret;
+}
+
+/*
+ * Distributed SUMMA
+ *
+ * ranks 個 process 排成 pr × pc 的 grid，rank (i, j) 只持有
+ * A(I_i, Ka_j)、B(Kb_i, J_j) 與 C(I_i, J_j) 三塊，每個 process 的記憶體
+ * 只跟自己那塊有關。k 軸以 Ka、Kb 兩組切點的聯集切成 panel（每段最寬
+ * SUMMA_PANEL），每個 panel：
+ *   1. 持有 A(I_i, panel) 的 rank 在 row i 內廣播它，
+ *   2. 持有 B(panel, J_j) 的 rank 在 column j 內廣播它，
+ *   3. 每個 rank 用自己的 thread pool 以 mm_tiled 算 C_ij += A_panel · B_panel。
+ * panel 在送出前就 pad 好（B 也轉置好），收到的直接丟給 mm_tiled。
+ *
+ * panel 交換透過 summa_transport_t，換 transport 不用動演算法；目前有
+ * POSIX shared memory 與 UNIX socket 兩種，都只能在同一台機器上跑。
+ */
+typedef struct {
+    size_t m, n, p;
+    int pr, pc;
+    size_t row_cut[SUMMA_MAX_RANKS + 1];   // I_i = [row_cut[i], row_cut[i + 1])
+    size_t col_cut[SUMMA_MAX_RANKS + 1];   // J_j
+    size_t ka_cut[SUMMA_MAX_RANKS + 1];    // A 的 k 切點，pc 段
+    size_t kb_cut[SUMMA_MAX_RANKS + 1];    // B 的 k 切點，pr 段
+    size_t *panel_cut;                     // n_panels + 1 個
+    size_t n_panels;
+    size_t max_panel_bytes;                // 最大的 pad 過的 A/B panel
+} summa_grid_t;
+
+/* 廣播的對象：group id 0..pr-1 是 row，pr..pr+pc-1 是 column */
+typedef struct {
+    int id;
+    int n;
+    int ranks[SUMMA_MAX_RANKS];            // member 的 global rank
+} summa_group_t;
+
+typedef struct summa_transport summa_transport_t;
+struct summa_transport {
+    const char *name;
+    int rank;                              // attach() 之後是自己的 rank
+    /* fork 之後在 rank 裡呼叫一次 */
+    void (*attach)(summa_transport_t *t, int rank);
+    /* root 的 buf 複製到 group 其他 member 的 buf；group 全員都要呼叫 */
+    int (*bcast)(summa_transport_t *t, const summa_group_t *g, int root,
+                 void *buf, size_t bytes);
+    void (*close)(summa_transport_t *t);
+};
+
+/* [0, len) 切 parts 段，切點對齊 TILE_SIZE，餘數給最後一段 */
+static void summa_cuts(size_t *cut, size_t len, int parts)
+{
+    for (int i = 0; i < parts; i++)
+        cut[i] = (size_t)i * (len / TILE_SIZE) / parts * TILE_SIZE;
+    cut[parts] = len;
+}
+
+/* cut[0..parts] 中 k 所在的段 */
+static int summa_owner(const size_t *cut, int parts, size_t k)
+{
+    int o = 0;
+    while (o + 1 < parts && cut[o + 1] <= k)
+        o++;
+    return o;
+}
+
+static int cmp_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* pr 取不超過 sqrt(ranks) 的最大因數，grid 盡量接近正方形 */
+static void summa_grid_init(summa_grid_t *gr, size_t m, size_t n, size_t p, int ranks)
+{
+    *gr = (summa_grid_t){.m = m, .n = n, .p = p, .pr = 1};
+    for (int r = 1; r * r <= ranks; r++)
+        if (ranks % r == 0)
+            gr->pr = r;
+    gr->pc = ranks / gr->pr;
+    summa_cuts(gr->row_cut, m, gr->pr);
+    summa_cuts(gr->col_cut, p, gr->pc);
+    summa_cuts(gr->ka_cut, n, gr->pc);
+    summa_cuts(gr->kb_cut, n, gr->pr);
+
+    /* 兩組切點合併、排序、去重，再把太寬的段切成 SUMMA_PANEL */
+    size_t n_cuts = gr->pc + gr->pr + 2, k = 0;
+    size_t *cuts = malloc(n_cuts * sizeof(size_t));
+    memcpy(cuts, gr->ka_cut, (gr->pc + 1) * sizeof(size_t));
+    memcpy(cuts + gr->pc + 1, gr->kb_cut, (gr->pr + 1) * sizeof(size_t));
+    qsort(cuts, n_cuts, sizeof(size_t), cmp_size);
+
+    size_t panel = ALIGN_UP(SUMMA_PANEL);
+    gr->panel_cut = malloc((n / panel + n_cuts + 1) * sizeof(size_t));
+    gr->panel_cut[k++] = 0;
+    for (size_t c = 1; c < n_cuts; c++) {
+        for (size_t x = cuts[c - 1] + panel; x < cuts[c]; x += panel)
+            gr->panel_cut[k++] = x;
+        if (cuts[c] > gr->panel_cut[k - 1])
+            gr->panel_cut[k++] = cuts[c];
+    }
+    gr->n_panels = k - 1;
+    free(cuts);
+
+    size_t max_mb = 0, max_pb = 0;
+    for (int i = 0; i < gr->pr; i++)
+        if (ALIGN_UP(gr->row_cut[i + 1] - gr->row_cut[i]) > max_mb)
+            max_mb = ALIGN_UP(gr->row_cut[i + 1] - gr->row_cut[i]);
+    for (int j = 0; j < gr->pc; j++)
+        if (ALIGN_UP(gr->col_cut[j + 1] - gr->col_cut[j]) > max_pb)
+            max_pb = ALIGN_UP(gr->col_cut[j + 1] - gr->col_cut[j]);
+    gr->max_panel_bytes = (max_mb > max_pb ? max_mb : max_pb) * panel * sizeof(float);
+}
+
+static summa_group_t summa_row(const summa_grid_t *gr, int i)
+{
+    summa_group_t g = {.id = i, .n = gr->pc};
+    for (int j = 0; j < gr->pc; j++)
+        g.ranks[j] = i * gr->pc + j;
+    return g;
+}
+
+static summa_group_t summa_col(const summa_grid_t *gr, int j)
+{
+    summa_group_t g = {.id = gr->pr + j, .n = gr->pr};
+    for (int i = 0; i < gr->pr; i++)
+        g.ranks[i] = i * gr->pc + j;
+    return g;
+}
+
+/*
+ * Shared-memory transport：一個 shm_open 出來的 segment，每個 group 一個
+ * PTHREAD_PROCESS_SHARED barrier 與一個 panel slot。root 寫進 slot，
+ * barrier 之後其他 member 讀出來，再一個 barrier 才能寫下一個 panel。
+ * segment 在 fork 前建好並立刻 shm_unlink，process 結束就會回收。
+ */
+typedef struct {
+    summa_transport_t base;
+    uint8_t *map;
+    size_t map_len, slot_bytes;
+    pthread_barrier_t *bar;     // 每個 group 一個
+    uint8_t *slots;
+} shm_transport_t;
+
+static void shm_attach(summa_transport_t *t, int rank)
+{
+    t->rank = rank;
+}
+
+static int shm_bcast(summa_transport_t *t, const summa_group_t *g, int root,
+                     void *buf, size_t bytes)
+{
+    shm_transport_t *s = (shm_transport_t *)t;
+    uint8_t *slot = s->slots + g->id * s->slot_bytes;
+    if (bytes > s->slot_bytes)
+        return -1;
+    if (t->rank == root)
+        memcpy(slot, buf, bytes);
+    pthread_barrier_wait(&s->bar[g->id]);
+    if (t->rank != root)
+        memcpy(buf, slot, bytes);
+    pthread_barrier_wait(&s->bar[g->id]);
+    return 0;
+}
+
+static void shm_close(summa_transport_t *t)
+{
+    shm_transport_t *s = (shm_transport_t *)t;
+    munmap(s->map, s->map_len);
+    free(s);
+}
+
+static summa_transport_t *summa_shm_create(const summa_grid_t *gr)
+{
+    char name[64];
+    int groups = gr->pr + gr->pc;
+    size_t bar_bytes = (groups * sizeof(pthread_barrier_t) + MEM_ALIGNMENT - 1) &
+                       ~(size_t)(MEM_ALIGNMENT - 1);
+    shm_transport_t *s = calloc(1, sizeof(shm_transport_t));
+    s->base = (summa_transport_t){
+        .name = "shm", .attach = shm_attach, .bcast = shm_bcast, .close = shm_close,
+    };
+    s->slot_bytes = gr->max_panel_bytes;
+    s->map_len = bar_bytes + groups * s->slot_bytes;
+
+    snprintf(name, sizeof(name), "/gemm-summa-%d", (int)getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        free(s);
+        return NULL;
+    }
+    shm_unlink(name);
+    s->map = ftruncate(fd, (off_t)s->map_len) == 0
+                 ? mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                 : MAP_FAILED;
+    close(fd);
+    if (s->map == MAP_FAILED) {
+        perror("shm mmap");
+        free(s);
+        return NULL;
+    }
+    s->bar = (pthread_barrier_t *)s->map;
+    s->slots = s->map + bar_bytes;
+
+    pthread_barrierattr_t attr;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    for (int g = 0; g < groups; g++)
+        pthread_barrier_init(&s->bar[g], &attr, g < gr->pr ? gr->pc : gr->pr);
+    pthread_barrierattr_destroy(&attr);
+    return &s->base;
+}
+
+/*
+ * UNIX socket transport：每兩個 rank 之間一條 socketpair，fd[a * ranks + b]
+ * 是 a 這端。root 依序寫給每個 member，member 從連到 root 的那條讀。
+ * 同一對 rank 最多同屬一個 group，所以一條 socket 上的訊息順序就是 panel 順序。
+ */
+typedef struct {
+    summa_transport_t base;
+    int ranks;
+    int *fd;
+} sock_transport_t;
+
+static int write_full(int fd, const void *buf, size_t bytes)
+{
+    for (const uint8_t *q = buf; bytes > 0;) {
+        ssize_t w = write(fd, q, bytes);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        q += w;
+        bytes -= w;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t bytes)
+{
+    for (uint8_t *q = buf; bytes > 0;) {
+        ssize_t r = read(fd, q, bytes);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        q += r;
+        bytes -= r;
+    }
+    return 0;
+}
+
+/* 只留自己這端的 fd */
+static void sock_attach(summa_transport_t *t, int rank)
+{
+    sock_transport_t *s = (sock_transport_t *)t;
+    t->rank = rank;
+    for (int a = 0; a < s->ranks; a++)
+        for (int b = 0; b < s->ranks && a != rank; b++)
+            if (s->fd[a * s->ranks + b] >= 0) {
+                close(s->fd[a * s->ranks + b]);
+                s->fd[a * s->ranks + b] = -1;
+            }
+}
+
+static int sock_bcast(summa_transport_t *t, const summa_group_t *g, int root,
+                      void *buf, size_t bytes)
+{
+    sock_transport_t *s = (sock_transport_t *)t;
+    if (t->rank != root)
+        return read_full(s->fd[t->rank * s->ranks + root], buf, bytes);
+    for (int x = 0; x < g->n; x++)
+        if (g->ranks[x] != root && write_full(s->fd[root * s->ranks + g->ranks[x]], buf, bytes))
+            return -1;
+    return 0;
+}
+
+static void sock_close(summa_transport_t *t)
+{
+    sock_transport_t *s = (sock_transport_t *)t;
+    for (int x = 0; x < s->ranks * s->ranks; x++)
+        if (s->fd[x] >= 0)
+            close(s->fd[x]);
+    free(s->fd);
+    free(s);
+}
+
+static summa_transport_t *summa_socket_create(const summa_grid_t *gr)
+{
+    int ranks = gr->pr * gr->pc;
+    sock_transport_t *s = calloc(1, sizeof(sock_transport_t));
+    s->base = (summa_transport_t){
+        .name = "socket", .attach = sock_attach, .bcast = sock_bcast, .close = sock_close,
+    };
+    s->ranks = ranks;
+    s->fd = malloc(ranks * ranks * sizeof(int));
+    for (int x = 0; x < ranks * ranks; x++)
+        s->fd[x] = -1;
+    for (int a = 0; a < ranks; a++)
+        for (int b = a + 1; b < ranks; b++) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+                perror("socketpair");
+                sock_close(&s->base);
+                return NULL;
+            }
+            s->fd[a * ranks + b] = sv[0];
+            s->fd[b * ranks + a] = sv[1];
+        }
+    return &s->base;
+}
+
+static const struct {
+    const char *name;
+    summa_transport_t *(*create)(const summa_grid_t *gr);
+} summa_transports[] = {
+    {"shm", summa_shm_create},
+    {"socket", summa_socket_create},
+};
+
+/* 把 A(I_i, panel) pad 成 padmb × padkw */
+static void summa_pack_a(float *dst, const float *blk, size_t ld, size_t mb, size_t k0,
+                         size_t kw, size_t padmb, size_t padkw)
+{
+    memset(dst, 0, padmb * padkw * sizeof(float));
+    for (size_t r = 0; r < mb; r++)
+        memcpy(dst + r * padkw, blk + r * ld + k0, kw * sizeof(float));
+}
+
+/* 把 B(panel, J_j) 轉置、pad 成 padpb × padkw */
+static void summa_pack_b(float *dst, const float *blk, size_t pb, size_t k0,
+                         size_t kw, size_t padpb, size_t padkw)
+{
+    memset(dst, 0, padpb * padkw * sizeof(float));
+    for (size_t k = 0; k < kw; k++)
+        for (size_t c = 0; c < pb; c++)
+            dst[c * padkw + k] = blk[(k0 + k) * pb + c];
+}
+
+/* rank (i, j)：讀自己的 A、B block，跑完所有 panel，把 C block 寫回檔案 */
+static int summa_rank(const summa_grid_t *gr, summa_transport_t *t, int rank,
+                      const char *path_a, const char *path_b, const char *path_c,
+                      size_t threads, const int *cpus, size_t n_cpus)
+{
+    int i = rank / gr->pc, j = rank % gr->pc;
+    size_t i0 = gr->row_cut[i], mb = gr->row_cut[i + 1] - i0;
+    size_t j0 = gr->col_cut[j], pb = gr->col_cut[j + 1] - j0;
+    size_t ka0 = gr->ka_cut[j], kaw = gr->ka_cut[j + 1] - ka0;
+    size_t kb0 = gr->kb_cut[i], kbh = gr->kb_cut[i + 1] - kb0;
+    size_t padmb = ALIGN_UP(mb), padpb = ALIGN_UP(pb);
+    summa_group_t row = summa_row(gr, i), col = summa_col(gr, j);
+    mat_file_t a = {.fd = -1}, b = {.fd = -1};
+    threadpool_t pool;
+    int ret = -1;
+
+    /* 各 rank 用 CPU 清單上不重疊的一段，pool 的 topology 在這段裡面排 */
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t w = 0; w < threads; w++)
+        CPU_SET(cpus[(rank * threads + w) % n_cpus], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+
+    float *blk_a = malloc((mb * kaw + 1) * sizeof(float));
+    float *blk_b = malloc((kbh * pb + 1) * sizeof(float));
+    float *blk_c = calloc(mb * pb + 1, sizeof(float));
+    if (mat_file_open(&a, path_a) != 0 || mat_file_open(&b, path_b) != 0)
+        goto out;
+    for (size_t r = 0; r < mb; r++)
+        memcpy(blk_a + r * kaw, a.data + (i0 + r) * gr->n + ka0, kaw * sizeof(float));
+    for (size_t k = 0; k < kbh; k++)
+        memcpy(blk_b + k * pb, b.data + (kb0 + k) * gr->p + j0, pb * sizeof(float));
+    mat_file_close(&a);
+    mat_file_close(&b);
+    a.fd = b.fd = -1;
+    a.map = b.map = NULL;
+
+    init_thread_pool(&pool, threads, STEAL_CHUNK + 1, TOPO_CORES);
+    size_t max_kw = ALIGN_UP(SUMMA_PANEL);
+    float *pan_a = ws_alloc(&pool.ws, padmb * max_kw * sizeof(float));
+    float *pan_b = ws_alloc(&pool.ws, padpb * max_kw * sizeof(float));
+    float *prod = ws_alloc(&pool.ws, padmb * padpb * sizeof(float) + MEM_ALIGNMENT);
+
+    for (size_t s = 0; s < gr->n_panels; s++) {
+        size_t k0 = gr->panel_cut[s], kw = gr->panel_cut[s + 1] - k0, padkw = ALIGN_UP(kw);
+        int ja = summa_owner(gr->ka_cut, gr->pc, k0), ib = summa_owner(gr->kb_cut, gr->pr, k0);
+        int root_a = i * gr->pc + ja, root_b = ib * gr->pc + j;
+
+        if (rank == root_a)
+            summa_pack_a(pan_a, blk_a, kaw, mb, k0 - ka0, kw, padmb, padkw);
+        if (rank == root_b)
+            summa_pack_b(pan_b, blk_b, pb, k0 - kb0, kw, padpb, padkw);
+        if (t->bcast(t, &row, root_a, pan_a, padmb * padkw * sizeof(float)) != 0 ||
+            t->bcast(t, &col, root_b, pan_b, padpb * padkw * sizeof(float)) != 0) {
+            fprintf(stderr, "rank %d: %s transport failed at panel %zu\n", rank, t->name, s);
+            goto out_pool;
+        }
+        if (mb == 0 || pb == 0)
+            continue;   // 空的 block 也要參加廣播
+
+        mm_tiled(pan_a, pan_b, prod, padmb, padkw, padpb, NULL, NULL, &pool);
+        for (size_t r = 0; r < mb; r++)
+            for (size_t c = 0; c < pb; c++)
+                blk_c[r * pb + c] += prod[r * padpb + c];
+    }
+
+    /* 每個 rank 只寫自己那塊 C；檔案已經由 parent 建好 */
+    int fd = open(path_c, O_WRONLY);
+    ret = fd < 0 ? -1 : 0;
+    for (size_t r = 0; r < mb && ret == 0; r++) {
+        off_t off = sizeof(mat_hdr_t) + ((i0 + r) * gr->p + j0) * sizeof(float);
+        if (pwrite(fd, blk_c + r * pb, pb * sizeof(float), off) != (ssize_t)(pb * sizeof(float)))
+            ret = -1;
+    }
+    if (fd >= 0)
+        close(fd);
+    if (ret != 0)
+        perror(path_c);
+out_pool:
+    destroy_thread_pool(&pool);
+out:
+    mat_file_close(&a);
+    mat_file_close(&b);
+    free(blk_a);
+    free(blk_b);
+    free(blk_c);
+    return ret;
+}
+
+int mm_summa(const char *path_a, const char *path_b, const char *path_c, int ranks,
+             const char *transport)
+{
+    mat_file_t a = {.fd = -1}, b = {.fd = -1}, c = {.fd = -1};
+    summa_grid_t gr = {0};
+    summa_transport_t *t = NULL;
+    int ret = -1;
+
+    if (ranks < 1 || ranks > SUMMA_MAX_RANKS) {
+        fprintf(stderr, "ranks must be between 1 and %d\n", SUMMA_MAX_RANKS);
+        return -1;
+    }
+    if (mat_file_open(&a, path_a) != 0 || mat_file_open(&b, path_b) != 0)
+        goto out;
+    if (a.cols != b.rows) {
+        fprintf(stderr, "shape mismatch: A is %zux%zu, B is %zux%zu\n",
+                a.rows, a.cols, b.rows, b.cols);
+        goto out;
+    }
+    if (mat_file_create(&c, path_c, a.rows, b.cols) != 0)
+        goto out;
+
+    summa_grid_init(&gr, a.rows, a.cols, b.cols, ranks);
+    for (size_t x = 0; x < sizeof(summa_transports) / sizeof(summa_transports[0]); x++)
+        if (strcmp(transport, summa_transports[x].name) == 0)
+            t = summa_transports[x].create(&gr);
+    if (!t) {
+        fprintf(stderr, "transport %s is not available\n", transport);
+        goto out;
+    }
+
+    /* 整機的 worker 平分給各 rank */
+    int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+    size_t cores, n_cpus = topo_cpus(TOPO_CORES, cpus, &cores);
+    size_t threads = pool_default_threads(TOPO_CORES) / ranks;
+    if (threads == 0)
+        threads = 1;
+    pid_t *pids = calloc(ranks, sizeof(pid_t));
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+    int started = 0;
+    for (; started < ranks; started++) {
+        pids[started] = fork();
+        if (pids[started] < 0) {
+            perror("fork");
+            break;
+        }
+        if (pids[started] == 0) {
+            t->attach(t, started);
+            _exit(summa_rank(&gr, t, started, path_a, path_b, path_c,
+                             threads, cpus, n_cpus) == 0 ? 0 : 1);
+        }
+    }
+    /* 有 rank 失敗，其他 rank 會卡在廣播，全部收掉 */
+    ret = started == ranks ? 0 : -1;
+    for (int done = 0; done < started; done++) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            break;
+        if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && ret == 0) {
+            ret = -1;
+            for (int r = 0; r < started; r++)
+                if (pids[r] != pid)
+                    kill(pids[r], SIGTERM);
+        }
+    }
+    if (ret != 0 && started < ranks)
+        for (int r = 0; r < started; r++)
+            kill(pids[r], SIGTERM);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    #ifndef VALIDATE
+    if (ret == 0) {
+        double elapsed = (end.tv_sec - start.tv_sec) +
+                         (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Time: %.6f sec\n", elapsed);
+        printf("Grid: %d x %d ranks, %zu panels, %zu threads per rank, transport %s\n",
+               gr.pr, gr.pc, gr.n_panels, threads, t->name);
+    }
+    #endif
+
+    t->close(t);
+    free(pids);
+    free(cpus);
+out:
+    free(gr.panel_cut);
+    mat_file_close(&a);
+    mat_file_close(&b);
+    mat_file_close(&c);
+    return ret;
+}
+
+#ifdef VALIDATE
+/* 直接照定義算 conv2d，只給 --conv 驗證用 */
+static float conv_ref(const float *in, const float *w, const conv_shape_t *sh,
+                      size_t img, size_t k, size_t oy, size_t ox)
+{
+    float sum = 0;
+    for (size_t c = 0; c < sh->c; c++)
+        for (size_t r = 0; r < sh->r; r++)
+            for (size_t s = 0; s < sh->s; s++) {
+                long iy = (long)(oy * sh->stride + r) - (long)sh->pad;
+                long ix = (long)(ox * sh->stride + s) - (long)sh->pad;
+                if (iy < 0 || iy >= (long)sh->h || ix < 0 || ix >= (long)sh->w)
+                    continue;
+                bool nchw = sh->layout == LAYOUT_NCHW;
+                float x = nchw ? in[((img * sh->c + c) * sh->h + iy) * sh->w + ix]
+                               : in[((img * sh->h + iy) * sh->w + ix) * sh->c + c];
+                float f = nchw ? w[((k * sh->c + c) * sh->r + r) * sh->s + s]
+                               : w[((k * sh->r + r) * sh->s + s) * sh->c + c];
+                sum += x * f;
+            }
+    return sum;
+}
+#endif
+
+/* --conv n c h w k r [stride] [pad] [nhwc] */
+static int conv_main(int argc, char *argv[])
+{
+    conv_shape_t sh = {
+        .n = parse_int(argv[2]), .c = parse_int(argv[3]),
+        .h = parse_int(argv[4]), .w = parse_int(argv[5]),
+        .k = parse_int(argv[6]), .r = parse_int(argv[7]),
+        .stride = argc > 8 ? parse_int(argv[8]) : 1,
+        .pad = argc > 9 ? parse_int(argv[9]) : 0,
+        .layout = argc > 10 && strcmp(argv[10], "nhwc") == 0 ? LAYOUT_NHWC : LAYOUT_NCHW,
+    };
+    sh.s = sh.r;
+    if (sh.stride == 0)
+        sh.stride = 1;
+    size_t oh = conv_out_dim(sh.h, sh.r, sh.stride, sh.pad);
+    size_t ow = conv_out_dim(sh.w, sh.s, sh.stride, sh.pad);
+    size_t in_len = sh.n * sh.c * sh.h * sh.w, w_len = sh.k * sh.c * sh.r * sh.s;
+    size_t out_len = sh.n * sh.k * oh * ow;
+
+    float *in = malloc(in_len * sizeof(float));
+    float *w = malloc(w_len * sizeof(float));
+    float *out = malloc(out_len * sizeof(float));
+    fill_rand(in, in_len);
+    fill_rand(w, w_len);
+
+    threadpool_t pool;
+    init_thread_pool(&pool, pool_default_threads(TOPO_CORES), STEAL_CHUNK + 1, TOPO_CORES);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    conv2d(in, w, out, &sh, &pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    #ifndef VALIDATE
+        printf("Time: %.6f sec\n", (end.tv_sec - start.tv_sec) +
+                                   (end.tv_nsec - start.tv_nsec) / 1e9);
+        printf("Output %zux%zux%zux%zu, explicit im2col would need %.1f MB\n",
+               sh.n, sh.k, oh, ow,
+               sh.n * oh * ow * sh.c * sh.r * sh.s * sizeof(float) / 1048576.0);
+    #endif
+
+    #ifdef VALIDATE
+        double max_err = 0;
+        bool nchw = sh.layout == LAYOUT_NCHW;
+        for (size_t img = 0; img < sh.n; img++)
+            for (size_t k = 0; k < sh.k; k++)
+                for (size_t y = 0; y < oh; y++)
+                    for (size_t x = 0; x < ow; x++) {
+                        float got = nchw ? out[((img * sh.k + k) * oh + y) * ow + x]
+                                         : out[((img * oh + y) * ow + x) * sh.k + k];
+                        double err = got - conv_ref(in, w, &sh, img, k, y, x);
+                        if (err < 0)
+                            err = -err;
+                        if (err > max_err)
+                            max_err = err;
+                    }
+        printf("Max abs error vs direct conv: %g\n", max_err);
+    #endif
+
+    free(in);
+    free(w);
+    free(out);
+    destroy_thread_pool(&pool);
+    return 0;
+}
+
+/*
+ * Machine peaks (--peak)
+ *
+ * Roofline 的兩條線：FMA 峰值用和 mm_tile 內層一樣的 8 條獨立 FMA chain，
+ * 每個 worker 一個 task 同時跑；頻寬用 STREAM triad a = b + s·c，陣列切給
+ * 所有 worker。兩者都取 PEAK_REPS 次裡最好的一次。
+ */
+static void peak_fma(const task_t *task)
+{
+    __m256 c[MICRO_TILE], a = _mm256_set1_ps(0.999f), b = _mm256_set1_ps(1e-3f);
+    for (int v = 0; v < MICRO_TILE; ++v)
+        c[v] = _mm256_set1_ps((float)v);
+    for (size_t it = 0; it < task->n_k; it++)
+        for (int v = 0; v < MICRO_TILE; ++v)
+            c[v] = _mm256_fmadd_ps(a, c[v], b);
+    for (int v = 1; v < MICRO_TILE; ++v)
+        c[0] = _mm256_add_ps(c[0], c[v]);
+    task->C[0] = hsum256(c[0]);   // 結果要留下來，迴圈才不會被拿掉
+}
+
+/* C[x] = A[x] + s·B[x]，s 放在 rows（以 1/1000 為單位的整數） */
+static void peak_triad(const task_t *task)
+{
+    __m256 s = _mm256_set1_ps(task->rows / 1000.0f);
+    for (size_t x = 0; x < task->cols; x += 8)
+        _mm256_store_ps(task->C + x, _mm256_fmadd_ps(s, _mm256_load_ps(task->B + x),
+                                                      _mm256_load_ps(task->A + x)));
+}
+
+static double peak_run(threadpool_t *pool, const task_t *tasks)
+{
+    double best = 0;
+    for (int rep = 0; rep < PEAK_REPS; rep++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (size_t w = 0; w < pool->num_threads; w++)
+            enqueue_to(pool, w, tasks[w]);
+        wait_for_completion(pool);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (best == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static int peak_main(size_t threads)
+{
+    threadpool_t pool;
+    init_thread_pool(&pool, threads ? threads : pool_default_threads(TOPO_CORES),
+                     STEAL_CHUNK + 1, TOPO_CORES);
+    size_t nt = pool.num_threads;
+    task_t *tasks = calloc(nt, sizeof(task_t));
+    float *sink = calloc(nt, sizeof(float));
+
+    for (size_t w = 0; w < nt; w++)
+        tasks[w] = (task_t){.run = peak_fma, .C = sink + w, .n_k = PEAK_FMA_ITERS};
+    double t_fma = peak_run(&pool, tasks);
+    double flops = 2.0 * MICRO_TILE * 8 * PEAK_FMA_ITERS * nt;
+
+    size_t len = ((size_t)PEAK_STREAM_MB << 20) / sizeof(float);
+    size_t chunk = (len / nt) & ~(size_t)(TILE_SIZE - 1);
+    float *a = ws_alloc(&pool.ws, 3 * len * sizeof(float));
+    float *b = a + len, *c = b + len;
+    for (size_t x = 0; x < 3 * len; x++)
+        a[x] = 1.0f;
+    for (size_t w = 0; w < nt; w++)
+        tasks[w] = (task_t){.run = peak_triad, .A = a + w * chunk, .B = b + w * chunk,
+                            .C = c + w * chunk, .cols = chunk, .rows = 3000};
+    double t_bw = peak_run(&pool, tasks);
+    double bytes = 3.0 * chunk * nt * sizeof(float);
+
+    printf("Threads: %zu\n", nt);
+    printf("Peak FMA: %.2f GFLOP/s\n", flops / t_fma / 1e9);
+    printf("Peak bandwidth: %.2f GB/s\n", bytes / t_bw / 1e9);
+    printf("Ridge point: %.2f FLOP/byte\n", (flops / t_fma) / (bytes / t_bw));
+
+    free(tasks);
+    free(sink);
+    destroy_thread_pool(&pool);
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * --mixed：背景一直跑 m×n×p 的 PRIO_NORMAL job，前景依序送 n_small 個
+ * MIXED_DIM³ 的小 GEMM，分別用 PRIO_NORMAL 和 PRIO_HIGH 量延遲分布。
+ */
+static void mixed_latency(const float *A, const float *B, float *C,
+                          size_t m, size_t n, size_t p, size_t n_small,
+                          threadpool_t *pool)
+{
+    size_t d = MIXED_DIM;
+    float *sa = malloc(d * d * sizeof(float));
+    float *sb = malloc(d * d * sizeof(float));
+    float *sc = malloc(d * d * sizeof(float));
+    double *lat = malloc(n_small * sizeof(double));
+    fill_rand(sa, d * d);
+    fill_rand(sb, d * d);
+
+    for (int prio = PRIO_NORMAL; prio < N_PRIO; prio++) {
+        gemm_job_t *bg = gemm_submit(pool, A, B, C, m, n, p, NULL, NULL, -1);
+        for (size_t s = 0; s < n_small; s++) {
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            gemm_job_t *job = gemm_submit_prio(pool, prio, sa, sb, sc, d, d, d,
+                                               NULL, NULL, -1);
+            gemm_wait(job);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            gemm_job_release(job);
+            lat[s] = (end.tv_sec - start.tv_sec) * 1e3 +
+                     (end.tv_nsec - start.tv_nsec) / 1e6;
+            if (gemm_done(bg)) {   // 背景負載不能斷
+                gemm_job_release(bg);
+                bg = gemm_submit(pool, A, B, C, m, n, p, NULL, NULL, -1);
+            }
+        }
+        gemm_wait(bg);
+        gemm_job_release(bg);
+
+        qsort(lat, n_small, sizeof(double), cmp_double);
+        fprintf(stderr, "%s priority %zux%zux%zu: p50 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+                prio == PRIO_HIGH ? "high  " : "normal", d, d, d,
+                lat[n_small / 2], lat[(n_small - 1) * 99 / 100], lat[n_small - 1]);
+    }
+    free(sa);
+    free(sb);
+    free(sc);
+    free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 5 && strcmp(argv[1], "--gen") == 0)
+        return mat_file_write_rand(argv[2], parse_int(argv[3]), parse_int(argv[4])) ? 1 : 0;
+    if (argc >= 8 && strcmp(argv[1], "--conv") == 0)
+        return conv_main(argc, argv);
+    if (argc >= 2 && strcmp(argv[1], "--peak") == 0)
+        return peak_main(argc >= 3 ? parse_int(argv[2]) : 0);
+    if (argc >= 5 && strcmp(argv[1], "--stream") == 0) {
+        size_t budget_mb = argc >= 6 ? parse_int(argv[5]) : STREAM_BUDGET_MB;
+        return mm_stream(argv[2], argv[3], argv[4], budget_mb << 20) ? 1 : 0;
+    }
+    if (argc >= 6 && strcmp(argv[1], "--summa") == 0)
+        return mm_summa(argv[2], argv[3], argv[4], (int)parse_int(argv[5]),
+                        argc >= 7 ? argv[6] : "shm") ? 1 : 0;
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <m> <n> <p> [options]\n"
+                        "       %s --gen <file> <rows> <cols>\n"
+                        "       %s --stream <A> <B> <C> [budget_mb]\n"
+                        "       %s --summa <A> <B> <C> <ranks> [shm|socket]\n"
+                        "       %s --conv <n> <c> <h> <w> <k> <r> [stride] [pad] [nchw|nhwc]\n"
+                        "       %s --peak [threads]\n"
+                        "Options:\n"
+                        "  --iters N           repeat and report the mean time\n"
+                        "  --threads N         number of workers (default: cpuset and cgroup quota)\n"
+                        "  --topology cores|smt  one worker per physical core (default) or per\n"
+                        "                      hardware thread with siblings sharing A panels\n"
+                        "  --ws-stats          print workspace statistics\n"
+                        "  --no-huge           do not use huge pages\n"
+                        "  --pages             print the page backing of each workspace\n"
+                        "  --sched block|rr|hybrid  tile placement (default block)\n"
+                        "  --no-stream         never use non-temporal stores for C\n"
+                        "  --chain q1[,q2...]  multiply on by q1, q2... wide layers (pipelined)\n"
+                        "  --async             submit without blocking, wait on an eventfd via epoll\n"
+                        "  --mixed N           latency of N small GEMMs per priority under m x n x p load\n"
+                        "  --density PCT       keep only PCT%% of A non-zero (pruned weights)\n"
+                        "  --no-sparse         never switch to the CSR kernel\n"
+                        "  --block-density PCT keep only PCT%% of the 64x64 blocks of A and B\n"
+                        "  --no-skip           do not track or skip all-zero blocks\n"
+                        "  --no-split          never split k when there are fewer tiles than workers\n"
+                        "  --deterministic     same summation order for every thread count\n"
+                        "  --checksum          print a hash of the result bits\n"
+                        "  --op syrk|syr2k|trmm  C = A*At (p = m), A*Bt + B*At (p = m, B is m x n)\n"
+                        "                      or T*B with triangular T = A (n = m)\n"
+                        "  --lower             use the lower triangle for --op (default upper)\n"
+                        "  --mirror            fill both triangles of a syrk/syr2k result\n"
+                        "  --complex           interleaved complex CGEMM (matrices print as re, im pairs)\n"
+                        "  --plan              build a gemm plan once and execute it every iteration\n"
+                        "  --pack              pack B once and multiply with the packed handle\n"
+                        "  --pack-bf16         same, with B stored as bfloat16\n"
+                        "  --pack-file PATH    write the packed B to PATH and mmap it back\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    size_t m = parse_int(argv[1]);
+    size_t n = parse_int(argv[2]);
+    size_t p = parse_int(argv[3]);
+    size_t iters = 1, threads = 0;
+    topology_t topo = TOPO_CORES;
+    bool ws_stats = false, huge = true, pages = false;
+    place_mode_t place = PLACE_BLOCK;
+    bool stream_c = true, async = false;
+    size_t ticks = 0, mixed = 0, density = 100, block_density = 100;
+    bool sparse = true, block_skip = true, mirror = false, cplx = false, use_plan = false;
+    bool pack = false, split_k = true, deterministic = false, checksum = false;
+    pack_prec_t pack_prec = PACK_F32;
+    const char *pack_file = NULL;
+    const char *op = NULL;
+    uplo_t uplo = UPLO_UPPER;
+    size_t dims[MAX_CHAIN + 2] = {n, p}, layers = 1;
+
+    for (int a = 4; a < argc; a++) {
+        if (strcmp(argv[a], "--iters") == 0 && a + 1 < argc)
+            iters = parse_int(argv[++a]);
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+            threads = parse_int(argv[++a]);
+        else if (strcmp(argv[a], "--topology") == 0 && a + 1 < argc)
+            topo = strcmp(argv[++a], "smt") == 0 ? TOPO_SMT : TOPO_CORES;
+        else if (strcmp(argv[a], "--ws-stats") == 0)
+            ws_stats = true;
+        else if (strcmp(argv[a], "--no-huge") == 0)
+            huge = false;
+        else if (strcmp(argv[a], "--pages") == 0)
+            pages = true;
+        else if (strcmp(argv[a], "--sched") == 0 && a + 1 < argc) {
+            const char *mode = argv[++a];
+            place = strcmp(mode, "rr") == 0     ? PLACE_RR :
+                    strcmp(mode, "hybrid") == 0 ? PLACE_HYBRID : PLACE_BLOCK;
+        }
+        else if (strcmp(argv[a], "--no-stream") == 0)
+            stream_c = false;
+        else if (strcmp(argv[a], "--async") == 0)
+            async = true;
+        else if (strcmp(argv[a], "--mixed") == 0 && a + 1 < argc)
+            mixed = parse_int(argv[++a]);
+        else if (strcmp(argv[a], "--density") == 0 && a + 1 < argc)
+            density = parse_int(argv[++a]);
+        else if (strcmp(argv[a], "--no-sparse") == 0)
+            sparse = false;
+        else if (strcmp(argv[a], "--block-density") == 0 && a + 1 < argc)
+            block_density = parse_int(argv[++a]);
+        else if (strcmp(argv[a], "--no-skip") == 0)
+            block_skip = false;
+        else if (strcmp(argv[a], "--no-split") == 0)
+            split_k = false;
+        else if (strcmp(argv[a], "--deterministic") == 0)
+            deterministic = true;
+        else if (strcmp(argv[a], "--checksum") == 0)
+            checksum = true;
+        else if (strcmp(argv[a], "--op") == 0 && a + 1 < argc)
+            op = argv[++a];
+        else if (strcmp(argv[a], "--lower") == 0)
+            uplo = UPLO_LOWER;
+        else if (strcmp(argv[a], "--mirror") == 0)
+            mirror = true;
+        else if (strcmp(argv[a], "--complex") == 0)
+            cplx = true;
+        else if (strcmp(argv[a], "--plan") == 0)
+            use_plan = true;
+        else if (strcmp(argv[a], "--pack") == 0)
+            pack = true;
+        else if (strcmp(argv[a], "--pack-bf16") == 0)
+            pack = true, pack_prec = PACK_BF16;
+        else if (strcmp(argv[a], "--pack-file") == 0 && a + 1 < argc)
+            pack = true, pack_file = argv[++a];
+        else if (strcmp(argv[a], "--chain") == 0 && a + 1 < argc) {
+            for (char *q = argv[++a]; *q && layers <= MAX_CHAIN; q += *q == ',')
+                dims[++layers] = strtoul(q, &q, 10);
+        }
+    }
+    if (iters == 0)
+        iters = 1;
+    bool is_sym = op && (strcmp(op, "syrk") == 0 || strcmp(op, "syr2k") == 0);
+    if (is_sym)
+        p = m;   // syr2k 的 B 也就剛好是 m×n
+    else if (op)
+        n = m;   // trmm：T 是方陣
+    size_t cw = cplx ? 2 : 1;   // complex：每個元素兩個 float
+    dims[0] = n;
+    dims[1] = cw * p;
+
+    threadpool_t pool;
+
+    float *A = malloc(cw * m * n * sizeof(float));
+    float *B = malloc(cw * n * p * sizeof(float));
+    float *C = calloc(cw * m * p, sizeof(float));
+    fill_rand(A, cw * m * n);
+    fill_rand(B, cw * n * p);
+    for (size_t i = 0; density < 100 && i < m * n; i++)
+        if ((size_t)rand() % 100 >= density)
+            A[i] = 0.0f;
+    if (block_density < 100) {
+        zero_blocks(A, m, n, block_density);
+        zero_blocks(B, n, p, block_density);
+    }
+
+    /* --pack-file：存檔後丟掉記憶體裡的那份，改用 mmap 回來的 */
+    packed_b_t *packed = pack ? gemm_pack_b(B, n, p, pack_prec) : NULL;
+    if (packed && pack_file) {
+        bool saved = packed_b_save(packed, pack_file) == 0;
+        packed_b_free(packed);
+        packed = saved ? packed_b_load(pack_file) : NULL;
+        if (!packed) {
+            free(A);
+            free(B);
+            free(C);
+            return 1;
+        }
+    }
+
+    /* --chain：W[0] = B，後面每層再乘一個隨機矩陣 */
+    const float *W[MAX_CHAIN + 1] = {B};
+    for (size_t l = 1; l < layers; l++) {
+        float *w = malloc(dims[l] * dims[l + 1] * sizeof(float));
+        fill_rand(w, dims[l] * dims[l + 1]);
+        W[l] = w;
+    }
+    float *Y = layers > 1 ? malloc(m * dims[layers] * sizeof(float)) : C;
+
+    init_thread_pool(&pool, threads ? threads : pool_default_threads(topo), STEAL_CHUNK + 1,
+                     topo);
+    pool_set_huge(&pool, huge);
+    pool.place = place;
+    pool.stream_c = stream_c;
+    pool.sparse = sparse;
+    pool.block_skip = block_skip;
+    pool.split_k = split_k;
+    pool.deterministic = deterministic;
+
+    if (mixed)
+        mixed_latency(A, B, C, m, n, p, mixed, &pool);
+    gemm_plan_t *plan = use_plan ? gemm_plan_create(&pool, m, n, p, GEMM_ROW_MAJOR, 0) : NULL;
+
+    /* 重複呼叫時 workspace 只在第一輪長大，之後都是同一塊記憶體 */
+    double elapsed = 0;
+    for (size_t it = 0; it < iters && !mixed; it++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (layers > 1)
+            mm_chain(A, W, dims, layers, Y, m, &pool);
+        else if (op && strcmp(op, "syrk") == 0)
+            syrk(A, C, m, n, uplo, mirror, &pool);
+        else if (op && strcmp(op, "syr2k") == 0)
+            syr2k(A, B, C, m, n, uplo, mirror, &pool);
+        else if (op)
+            trmm(A, B, C, m, p, uplo, &pool);
+        else if (cplx)
+            cgemm(A, B, C, m, n, p, &pool);
+        else if (async)
+            ticks += mm_async_epoll(A, B, C, m, n, p, &pool);
+        else if (plan)
+            gemm_plan_execute(plan, A, B, C);
+        else if (packed)
+            mm_packed(A, packed, C, m, &pool);
+        else
+            mm(A, B, C, m, n, p, &pool);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed += (end.tv_sec - start.tv_sec) +
+                   (end.tv_nsec - start.tv_nsec) / 1e9;
+    }
+
+    #ifndef VALIDATE
+    if (!mixed) {
+        printf("Time: %.6f sec\n", elapsed / iters);
+        if (async)
+            printf("Event loop ticks while waiting: %zu\n", ticks / iters);
+    }
+    #endif
+    if (checksum)
+        printf("Checksum: %016llx\n", (unsigned long long)hash_bits(Y, m * dims[layers]));
 
     #ifdef VALIDATE
-        print_mat(C, m, p);
+        print_mat(A, m, cw * n);
+        if (op && strcmp(op, "syr2k") == 0)
+            print_mat(B, m, n);
+        for (size_t l = 0; l < layers && !is_sym; l++)
+            print_mat(W[l], dims[l], dims[l + 1]);
+        print_mat(Y, m, dims[layers]);
     #endif
+    if (ws_stats)
+        pool_print_stats(&pool);
+    if (pages)
+        pool_print_pages(&pool);
+    for (size_t l = 1; l < layers; l++)
+        free((float *)W[l]);
+    if (Y != C)
+        free(Y);
     free(A);
     free(B);
     free(C);
-    free(padA);
-    free(padB);
-    free(padC);
+    if (packed)
+        packed_b_free(packed);
     destroy_thread_pool(&pool);
     return 0;
 }
\ No newline at end of file
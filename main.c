@@ -16,6 +16,8 @@
 #define N_CORES 12
 #endif
 
+#define NODES_PER_SLAB 256
+
 #define ALIGN_UP(x) (((x) + TILE_SIZE - 1) & ~(TILE_SIZE - 1))
 
 typedef struct {
@@ -29,8 +31,16 @@ typedef struct queue_node_t {
     struct queue_node_t *next;
 } queue_node_t;
 
+//一次配一整塊 node，用完的 node 回到 free list，不再每個 task malloc/free
+typedef struct node_slab_t {
+    struct node_slab_t *next;
+    queue_node_t nodes[NODES_PER_SLAB];
+} node_slab_t;
+
 typedef struct {
     queue_node_t *head, *tail;
+    queue_node_t *free_nodes;   // recycled nodes, protected by lock
+    node_slab_t *slabs;         // every slab, freed by destroy_thread_pool
     pthread_mutex_t lock;
     pthread_cond_t not_empty, all_done;
     pthread_t *threads;
@@ -73,14 +83,17 @@ void *worker_thread(void *arg)
             return NULL;
         }
 
+        //task 先複製出來，node 趁還拿著 lock 直接還給 free list
         queue_node_t *node = pool->head;
+        task_t task = node->task;
         pool->head = node->next;
         if (!pool->head)
             pool->tail = NULL;
+        node->next = pool->free_nodes;
+        pool->free_nodes = node;
         pthread_mutex_unlock(&pool->lock);
 
-        mm_tile(&node->task);
-        free(node);
+        mm_tile(&task);
 
         //任務數量減 1，使用 atomic 確保 thread-safe
         atomic_fetch_sub(&pool->tasks_remaining, 1);
@@ -113,24 +126,54 @@ void init_thread_pool(threadpool_t *pool, size_t num_threads)
     }
 }
 
-void enqueue(threadpool_t *pool, task_t task)
+//呼叫時要拿著 lock；free list 空了才配新的 slab
+static queue_node_t *node_get(threadpool_t *pool)
+{
+    if (!pool->free_nodes) {
+        node_slab_t *slab = malloc(sizeof(node_slab_t));
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        for (size_t i = 0; i < NODES_PER_SLAB; i++) {
+            slab->nodes[i].next = pool->free_nodes;
+            pool->free_nodes = &slab->nodes[i];
+        }
+    }
+    queue_node_t *node = pool->free_nodes;
+    pool->free_nodes = node->next;
+    return node;
+}
+
+//一次 lock 放進 n 個 task，只喚醒一次
+void enqueue_batch(threadpool_t *pool, const task_t *tasks, size_t n)
 {
-    queue_node_t *node = malloc(sizeof(queue_node_t));
-    *node = (queue_node_t){.task = task, .next = NULL};
+    if (n == 0)
+        return;
 
     pthread_mutex_lock(&pool->lock);
-    atomic_fetch_add(&pool->tasks_remaining, 1);
-    if (pool->tail)
-        pool->tail->next = node;
-    else
-        pool->head = node;
-    pool->tail = node;
+    atomic_fetch_add(&pool->tasks_remaining, n);
+    for (size_t i = 0; i < n; i++) {
+        queue_node_t *node = node_get(pool);
+        *node = (queue_node_t){.task = tasks[i], .next = NULL};
+        if (pool->tail)
+            pool->tail->next = node;
+        else
+            pool->head = node;
+        pool->tail = node;
+    }
 
-    //有一條新的任務近來，喚醒一條 worker thread
-    pthread_cond_signal(&pool->not_empty);
+    //只有一個 task 喚醒一條 worker 就夠，多個就全部叫醒
+    if (n == 1)
+        pthread_cond_signal(&pool->not_empty);
+    else
+        pthread_cond_broadcast(&pool->not_empty);
     pthread_mutex_unlock(&pool->lock);
 }
 
+void enqueue(threadpool_t *pool, task_t task)
+{
+    enqueue_batch(pool, &task, 1);
+}
+
 void wait_for_completion(threadpool_t *pool)
 {
     pthread_mutex_lock(&pool->lock);
@@ -149,9 +192,9 @@ void destroy_thread_pool(threadpool_t *pool)
     for (size_t i = 0; i < pool->num_threads; i++)
         pthread_join(pool->threads[i], NULL);
 
-    while (pool->head) {
-        queue_node_t *tmp = pool->head;
-        pool->head = tmp->next;
+    while (pool->slabs) {
+        node_slab_t *tmp = pool->slabs;
+        pool->slabs = tmp->next;
         free(tmp);
     }
     free(pool->threads);
@@ -168,9 +211,11 @@ void mm(float *A,
         size_t p,
         threadpool_t *pool)
 {
+    task_t *tasks = malloc((m / TILE_SIZE) * (p / TILE_SIZE) * sizeof(task_t));
+    size_t n_tasks = 0;
     for (size_t i = 0; i < m; i += TILE_SIZE) {
         for (size_t j = 0; j < p; j += TILE_SIZE) {
-            task_t task = {
+            tasks[n_tasks++] = (task_t){
                 .A = A + i * n,       //轉成一維的列
                 .B = B + j * n,      //轉成一維的行
                 .C = C + i * p + j, //轉成一維的列行
@@ -179,10 +224,11 @@ void mm(float *A,
                 .stride_c = p,
                 .n_k = n,
             };
-            enqueue(pool, task);
         }
     }
+    enqueue_batch(pool, tasks, n_tasks);
     wait_for_completion(pool);
+    free(tasks);
 }
 
 float *pad_mat(const float *src, size_t r, size_t c, size_t padr, size_t padc)
@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""Performance regression check against a stored baseline.
+
+Runs every engine on a fixed shape matrix several times, keeps the median and
+the median absolute deviation (MAD) of the reported time, and compares them
+with perf_baseline.txt. A case only counts as a regression when it is both
+slower by more than --min-rel, by more than --min-abs seconds and by more than
+--sigmas robust standard deviations of the combined noise, so timer jitter on
+tiny shapes does not fail the check.
+
+    python3 perfcheck.py            # compare, exit 1 on regressions
+    python3 perfcheck.py --update   # record a new baseline
+"""
+import argparse
+import os
+import platform
+import statistics
+import subprocess
+import sys
+
+ENGINES = ["unoptimized", "main", "lockfree", "lockfree_rr", "lockfree_rr_SIMD"]
+
+# square, tall-skinny, tiny and odd sizes
+SHAPES = [
+    (512, 512, 512),
+    (1024, 1024, 1024),
+    (8192, 64, 64),
+    (64, 64, 8192),
+    (8, 8, 8),
+    (33, 33, 33),
+    (257, 129, 65),
+    (999, 1001, 1000),
+]
+
+MAD_TO_SIGMA = 1.4826   # MAD of a normal distribution → standard deviation
+
+
+def host_id():
+    """CPU model and CPU count, stored with the baseline."""
+    model = platform.processor() or "unknown"
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    model = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    return f"{model} x{os.cpu_count()}"
+
+
+def run_time(exe, m, n, p):
+    """Run one bench binary and return its reported time in seconds."""
+    cmd = [f"./build/{exe}_bench", str(m), str(n), str(p)]
+    out = subprocess.run(cmd, capture_output=True, text=True, check=True).stdout
+    for line in out.splitlines():
+        if line.strip().startswith("Time:"):
+            return float(line.split()[1])
+    return float(out.split()[-1])   # unoptimized prints only the seconds
+
+
+def measure(cases, reps):
+    """Median and MAD per case. The reps are interleaved across all cases, so
+    a machine that drifts during the run widens every MAD instead of shifting
+    whichever cases happened to run during the slow period."""
+    times = {case: [] for case in cases}
+    for case in cases:
+        run_time(case[0], *case[1])          # warm-up, discarded
+    for r in range(reps):
+        print(f"Pass {r + 1}/{reps}...", flush=True)
+        for case in cases:
+            times[case].append(run_time(case[0], *case[1]))
+    stats = {}
+    for (engine, shape), ts in times.items():
+        med = statistics.median(ts)
+        stats[(engine, shape_name(shape))] = (med, statistics.median(abs(t - med) for t in ts))
+    return stats
+
+
+def shape_name(shape):
+    return "x".join(str(d) for d in shape)
+
+
+def load_baseline(path):
+    base, host = {}, None
+    with open(path) as f:
+        for line in f:
+            if line.startswith("# host:"):
+                host = line.split(":", 1)[1].strip()
+            if line.startswith("#") or not line.strip():
+                continue
+            engine, shape, med, mad = line.split()[:4]
+            base[(engine, shape)] = (float(med), float(mad))
+    return base, host
+
+
+def write_baseline(path, results, reps):
+    with open(path, "w") as f:
+        f.write(f"# host: {host_id()}\n")
+        f.write(f"# reps: {reps}\n")
+        f.write("# engine          shape              median_sec   mad_sec\n")
+        for (engine, shape), (med, mad) in results.items():
+            f.write(f"{engine:<17} {shape:<18} {med:<12.6f} {mad:.6f}\n")
+
+
+def is_regression(base, new, args):
+    (b_med, b_mad), (n_med, n_mad) = base, new
+    noise = MAD_TO_SIGMA * (b_mad ** 2 + n_mad ** 2) ** 0.5
+    delta = n_med - b_med
+    return (delta > args.min_rel * b_med and delta > args.min_abs
+            and delta > args.sigmas * noise)
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("--baseline", default="perf_baseline.txt")
+    ap.add_argument("--update", action="store_true", help="record a new baseline")
+    ap.add_argument("--reps", type=int, default=5, help="runs per case")
+    ap.add_argument("--engines", default=",".join(ENGINES))
+    ap.add_argument("--min-rel", type=float, default=0.10,
+                    help="smallest relative slowdown that can fail (default 0.10)")
+    ap.add_argument("--min-abs", type=float, default=20e-6,
+                    help="smallest absolute slowdown in seconds (default 20us)")
+    ap.add_argument("--sigmas", type=float, default=3.0,
+                    help="slowdown must exceed this many noise sigmas (default 3)")
+    args = ap.parse_args()
+
+    # the baseline is per machine and not part of the repository
+    if not args.update and not os.path.exists(args.baseline):
+        print(f"❌ No baseline at {args.baseline}: run 'make perfcheck_baseline' first "
+              "on this machine")
+        sys.exit(2)
+
+    cases = [(engine, shape) for engine in args.engines.split(",") for shape in SHAPES]
+    results = measure(cases, args.reps)
+
+    if args.update:
+        write_baseline(args.baseline, results, args.reps)
+        print(f"\n✅ Baseline written to {args.baseline}")
+        return
+
+    base, host = load_baseline(args.baseline)
+    if host and host != host_id():
+        print(f"⚠️  Baseline was recorded on '{host}', this is '{host_id()}'")
+
+    print(f"\n{'engine':<17} {'shape':<18} {'base':>10} {'now':>10} {'change':>8}")
+    regressions = 0
+    for key, new in results.items():
+        if key not in base:
+            print(f"{key[0]:<17} {key[1]:<18} {'-':>10} {new[0]:>10.6f}   (new)")
+            continue
+        old = base[key]
+        change = (new[0] / old[0] - 1) * 100 if old[0] > 0 else 0
+        slow = is_regression(old, new, args)
+        regressions += slow
+        mark = "  ❌ slower" if slow else ""
+        print(f"{key[0]:<17} {key[1]:<18} {old[0]:>10.6f} {new[0]:>10.6f} {change:>+7.1f}%{mark}")
+
+    if regressions:
+        print(f"\n❌ {regressions} significant slowdown(s)")
+        sys.exit(1)
+    print("\n✅ No significant slowdowns.")
+
+
+if __name__ == "__main__":
+    main()